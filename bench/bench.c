@@ -0,0 +1,269 @@
+/*
+ * Micro-benchmarks for the interpreter.
+ *
+ * Measures the time per call of each instruction handler through its decoded op pointer, the
+ * instructions per second of full dispatch on a few synthetic ROMs with each engine, and how
+ * many 60 Hz frames per second can be emulated and expanded to a framebuffer. The cost of the
+ * handler loop around an empty op is reported as loop_overhead_ns. Engines that are not built
+ * in are reported as null. Results are printed as JSON on stdout.
+ *
+ *	cc -std=c99 -O2 -o bench bench/bench.c
+ *	cc -std=c99 -O2 -DCHIP8_JIT -o bench bench/bench.c
+ *	./bench [scale]
+ *
+ * scale multiplies every iteration count and defaults to 1.
+ */
+#define _POSIX_C_SOURCE 199309L
+
+#include "../chip8.c"
+
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_HANDLER_CALLS 10000000
+#define BENCH_ROM_CYCLES 50000000
+#define BENCH_FRAMES 20000
+#define BENCH_FRAME_IPS 700
+#define BENCH_SCALE 10
+
+struct bench_handler {
+	const char *name;
+	u16 opcode;
+};
+
+struct bench_rom {
+	const char *name;
+	const u8 *code;
+	size_t len;
+};
+
+static const struct bench_handler handlers[] = {
+	{ "00Cn", 0x00C4 }, { "00E0", 0x00E0 }, { "00EE", 0x00EE }, { "00FB", 0x00FB },
+	{ "00FC", 0x00FC }, { "00FF", 0x00FF }, { "00FE", 0x00FE }, { "0nnn", 0x0123 },
+	{ "1nnn", 0x1200 }, { "2nnn", 0x2200 },
+	{ "3xkk", 0x3155 }, { "4xkk", 0x4155 }, { "5xy0", 0x5120 },
+	{ "6xkk", 0x6155 }, { "7xkk", 0x7155 },
+	{ "8xy0", 0x8120 }, { "8xy1", 0x8121 }, { "8xy2", 0x8122 }, { "8xy3", 0x8123 },
+	{ "8xy4", 0x8124 }, { "8xy5", 0x8125 }, { "8xy6", 0x8126 }, { "8xy7", 0x8127 },
+	{ "8xyE", 0x812E },
+	{ "9xy0", 0x9120 }, { "Annn", 0xA300 }, { "Bnnn", 0xB200 }, { "Cxkk", 0xC1FF },
+	{ "Dxyn", 0xD12F },
+	{ "Ex9E", 0xE19E }, { "ExA1", 0xE1A1 },
+	{ "Fx07", 0xF107 }, { "Fx0A", 0xF10A }, { "Fx15", 0xF115 }, { "Fx18", 0xF118 },
+	{ "Fx1E", 0xF11E }, { "Fx29", 0xF129 }, { "Fx33", 0xF133 }, { "Fx55", 0xF155 },
+	{ "Fx65", 0xF165 },
+};
+
+/* Register arithmetic and logic in a tight loop. */
+static const u8 rom_alu[] = {
+	0x60, 0x01, 0x61, 0x03, 0x62, 0x07,
+	0x80, 0x14, 0x81, 0x24, 0x82, 0x01, 0x83, 0x02, 0x84, 0x33,
+	0x85, 0x45, 0x86, 0x06, 0x87, 0x57, 0x88, 0x0E, 0x70, 0x01,
+	0x12, 0x06,
+};
+
+/* Sprites drawn all over the screen, clearing it every 256 draws. */
+static const u8 rom_draw[] = {
+	0xA3, 0x00, 0xD0, 0x1F, 0x70, 0x05, 0x71, 0x03,
+	0x72, 0x01, 0x32, 0x00, 0x12, 0x02, 0x00, 0xE0, 0x12, 0x02,
+};
+
+/* Nested subroutine calls. */
+static const u8 rom_call[] = {
+	0x23, 0x00, 0x23, 0x00, 0x12, 0x00,
+};
+
+static const u8 rom_call_sub[] = {
+	0x70, 0x01, 0x23, 0x10, 0x00, 0xEE,
+};
+
+static const u8 rom_call_leaf[] = {
+	0x71, 0x01, 0x00, 0xEE,
+};
+
+static const u8 sprite[15] = {
+	0xF0, 0x90, 0x90, 0x90, 0xF0, 0x20, 0x60, 0x20, 0x20, 0x70, 0xF0, 0x10, 0xF0, 0x80, 0xF0,
+};
+
+static const struct bench_rom roms[] = {
+	{ "alu", rom_alu, sizeof(rom_alu) },
+	{ "draw", rom_draw, sizeof(rom_draw) },
+	{ "call", rom_call, sizeof(rom_call) },
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void load(CHIP8 *ch8, const struct bench_rom *rom)
+{
+	memset(ch8, 0, sizeof(*ch8));
+	memcpy(ch8->memory + PROGRAM_START_ADDRESS, rom->code, rom->len);
+	memcpy(ch8->memory + 0x300, sprite, sizeof(sprite));
+	if (rom->code == rom_call) {
+		memcpy(ch8->memory + 0x300, rom_call_sub, sizeof(rom_call_sub));
+		memcpy(ch8->memory + 0x310, rom_call_leaf, sizeof(rom_call_leaf));
+	}
+	chip8_seed(ch8, 1);
+	ch8->pc = PROGRAM_START_ADDRESS;
+}
+
+/* Nanoseconds per call of the handler decoded from opcode, loop overhead included. */
+static double bench_handler(CHIP8 *ch8, u16 opcode, u32 calls)
+{
+	struct chip8_insn insn;
+	chip8_op volatile op;
+	double start;
+	u32 i;
+
+	/* The SUPER-CHIP instructions in the 0 group only decode as themselves under its profile. */
+	chip8_decode(opcode, &insn, opcode & 0xF000 ? ch8->quirks : CHIP8_QUIRKS_SCHIP);
+	op = insn.handler;
+	ch8->I = 0x300;
+	start = now();
+	for (i = 0; i < calls; i++) {
+		ch8->pc = PROGRAM_START_ADDRESS;
+		ch8->sp = 1;
+		op(ch8, &insn);
+	}
+	return (now() - start) * 1e9 / calls;
+}
+
+static void noop(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	(void)ch8;
+	(void)insn;
+}
+
+static double bench_loop_overhead(CHIP8 *ch8, u32 calls)
+{
+	struct chip8_insn insn;
+	chip8_op volatile op = noop;
+	double start;
+	u32 i;
+
+	start = now();
+	for (i = 0; i < calls; i++) {
+		ch8->pc = PROGRAM_START_ADDRESS;
+		ch8->sp = 1;
+		op(ch8, &insn);
+	}
+	return (now() - start) * 1e9 / calls;
+}
+
+enum bench_engine { ENGINE_INTERPRETER, ENGINE_CACHED, ENGINE_JIT };
+
+static const char *const engine_names[] = { "interpreter", "cached", "jit" };
+
+/* Instructions per second, or a negative value if the engine is not built in. */
+static double bench_rom(CHIP8 *ch8, const struct bench_rom *rom, enum bench_engine engine,
+			u32 cycles)
+{
+	static struct chip8_icache icache;
+#ifdef CHIP8_JIT
+	struct chip8_jit *jit = NULL;
+#endif
+	double start;
+	double elapsed;
+
+	load(ch8, rom);
+	if (engine == ENGINE_CACHED) {
+		chip8_icache_attach(ch8, &icache);
+	}
+	if (engine == ENGINE_JIT) {
+#ifdef CHIP8_JIT
+		jit = chip8_jit_create();
+		if (!jit) {
+			return -1;
+		}
+		chip8_jit_attach(ch8, jit);
+#else
+		return -1;
+#endif
+	}
+	start = now();
+	chip8_run(ch8, cycles);
+	elapsed = now() - start;
+#ifdef CHIP8_JIT
+	if (jit) {
+		chip8_jit_attach(ch8, NULL);
+		chip8_jit_destroy(jit);
+	}
+#endif
+	chip8_icache_attach(ch8, NULL);
+	return cycles / elapsed;
+}
+
+/* Emulated frames per second at BENCH_FRAME_IPS, expanding the display after every frame. */
+static double bench_frames(CHIP8 *ch8, const struct bench_rom *rom, u32 frames)
+{
+	static u32 pixels[DISPLAY_HEIGHT * BENCH_SCALE][64 * BENCH_SCALE];
+	struct chip8_surface surface = {
+		pixels, sizeof(pixels[0]), CHIP8_PIXEL_RGBA8, 0xFFFFFFFF, 0xFF000000, BENCH_SCALE,
+	};
+	struct chip8_clock clock;
+	double start;
+	u32 i;
+
+	load(ch8, rom);
+	chip8_clock_init(&clock, BENCH_FRAME_IPS);
+	start = now();
+	for (i = 0; i < frames; i++) {
+		chip8_run_frames(ch8, &clock, 1);
+		chip8_expand_display(ch8, &surface);
+	}
+	return frames / (now() - start);
+}
+
+static void print_number(double v)
+{
+	if (v < 0) {
+		printf("null");
+	} else {
+		printf("%.3f", v);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	static CHIP8 ch8;
+	u32 scale = argc > 1 ? (u32)strtoul(argv[1], NULL, 10) : 1;
+	double overhead;
+	size_t i;
+	int e;
+
+	if (!scale) {
+		scale = 1;
+	}
+	memset(&ch8, 0, sizeof(ch8));
+	memcpy(ch8.memory + 0x300, sprite, sizeof(sprite));
+	overhead = bench_loop_overhead(&ch8, BENCH_HANDLER_CALLS * scale);
+
+	printf("{\n\t\"loop_overhead_ns\": ");
+	print_number(overhead);
+	printf(",\n\t\"handler_ns\": {");
+	for (i = 0; i < sizeof(handlers) / sizeof(handlers[0]); i++) {
+		printf("%s\n\t\t\"%s\": ", i ? "," : "", handlers[i].name);
+		print_number(bench_handler(&ch8, handlers[i].opcode, BENCH_HANDLER_CALLS * scale));
+	}
+	printf("\n\t},\n\t\"rom_ips\": {");
+	for (i = 0; i < sizeof(roms) / sizeof(roms[0]); i++) {
+		printf("%s\n\t\t\"%s\": {", i ? "," : "", roms[i].name);
+		for (e = ENGINE_INTERPRETER; e <= ENGINE_JIT; e++) {
+			printf("%s\"%s\": ", e ? ", " : "", engine_names[e]);
+			print_number(bench_rom(&ch8, &roms[i], e, BENCH_ROM_CYCLES * scale));
+		}
+		printf("}");
+	}
+	printf("\n\t},\n\t\"frames_per_second\": {");
+	for (i = 0; i < sizeof(roms) / sizeof(roms[0]); i++) {
+		printf("%s\n\t\t\"%s\": ", i ? "," : "", roms[i].name);
+		print_number(bench_frames(&ch8, &roms[i], BENCH_FRAMES * scale));
+	}
+	printf("\n\t}\n}\n");
+	return 0;
+}
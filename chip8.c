@@ -1,13 +1,81 @@
+/*
+ * ROM files are mapped with mmap on Unix hosts. Define CHIP8_NO_MMAP to leave file loading out
+ * and load ROMs from memory only.
+ */
+#if !defined(CHIP8_MMAP) && defined(__unix__) && !defined(CHIP8_NO_MMAP)
+#define CHIP8_MMAP
+#endif
+
+#if (defined(CHIP8_JIT) || defined(CHIP8_THREADS) || defined(CHIP8_MMAP)) && \
+	!defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
+#include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
+/*
+ * The basic-block JIT is opt-in (-DCHIP8_JIT) and only has an x86-64 System V backend. On any
+ * other host the option is dropped and the interpreter is used.
+ */
+#if defined(CHIP8_JIT) && !(defined(__x86_64__) && defined(__unix__))
+#undef CHIP8_JIT
+#endif
+
+#if defined(CHIP8_JIT) || defined(CHIP8_MMAP)
+#include <sys/mman.h>
+#endif
+
+#ifdef CHIP8_JIT
+#include <unistd.h>
+#endif
+
+#ifdef CHIP8_MMAP
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef CHIP8_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#ifdef CHIP8_PROFILE
+#include <stdio.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 typedef uint8_t u8;
 typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
 
 #define MEMORY_SIZE 4096
 #define PROGRAM_START_ADDRESS 0x200
+#define FONT_ADDRESS 0x000
+#define FONT_SPRITE_SIZE 5
 #define DISPLAY_HEIGHT 32
 #define DISPLAY_LENGTH 64
+#define DISPLAY_HIRES_HEIGHT 64
+#define DISPLAY_HIRES_LENGTH 128
+#define MEMORY_PAGE_SIZE 256
+#define MEMORY_PAGES (MEMORY_SIZE / MEMORY_PAGE_SIZE)
+
+#define OPCODE_NNN(opcode) ((opcode) & 0x0FFF)
+#define OPCODE_N(opcode) ((opcode) & 0x000F)
+#define OPCODE_X(opcode) (((opcode) >> 8) & 0x0F)
+#define OPCODE_Y(opcode) (((opcode) >> 4) & 0x0F)
+#define OPCODE_KK(opcode) ((opcode) & 0x00FF)
 
 struct chip8 {
 	u8 memory[MEMORY_SIZE];
@@ -18,317 +86,6325 @@ struct chip8 {
 	u16 pc;
 	u8 sp;
 	u16 stack[16];
+#ifdef CHIP8_PACKED_KEYPAD
+	u16 keys;
+#else
 	u8 keypad[16];
+#endif
+#ifdef CHIP8_DISPLAY_ROWS64
+	u64 display[DISPLAY_HEIGHT];
+#else
 	u8 display[DISPLAY_HEIGHT * DISPLAY_LENGTH / 8];
+#endif
+	u8 hires;
+	u32 dirty_rows;
+	u64 hires_dirty_rows;
+	u64 rng_state;
+	u16 written_pages;
+#ifdef CHIP8_CHECKED
+	u8 fault;
+#endif
+	u64 cycles;
+	u8 quirks;
+	struct chip8_icache *icache;
+	struct chip8_jit *jit;
+	const struct chip8_aot *aot;
+	struct chip8_input_log *input;
+#ifdef CHIP8_PROFILE
+	struct chip8_profile *profile;
+#endif
+#ifdef CHIP8_TRACE
+	struct chip8_trace *trace;
+#endif
+	u64 hires_display[DISPLAY_HIRES_HEIGHT][2];
 };
 typedef struct chip8 CHIP8;
 
-static u16 chip8_fetch(CHIP8 *ch8)
+/*
+ * Pre-decoded instruction cache.
+ *
+ * One entry per even address, filled lazily the first time the instruction at that address is
+ * executed. An entry holds the resolved handler plus the unpacked operands, so a cache hit skips
+ * both the fetch from memory[] and the decode. A NULL handler marks an entry that still has to be
+ * decoded; chip8_write_memory clears it whenever the program writes over its own code.
+ *
+ * len is the number of instructions the handler executes: 1, or at most 2 to 3 for a
+ * superinstruction that chip8_run_cached fused into the entry at the start of a common sequence.
+ * The handler of an entry with len above 1 is a chip8_fused_op, stored as a chip8_op, and
+ * returns how many it did execute, which is fewer when a branch leaves the sequence early.
+ */
+struct chip8_insn;
+typedef void (*chip8_op)(CHIP8 *ch8, const struct chip8_insn *insn);
+typedef u32 (*chip8_fused_op)(CHIP8 *ch8, const struct chip8_insn *insn);
+
+struct chip8_insn {
+	chip8_op handler;
+	u16 nnn;
+	u8 x;
+	u8 y;
+	u8 kk;
+	u8 n;
+	u8 len;
+};
+
+/* A chip8_fused_op passes through void (*)(void) on its way into and out of an entry. */
+static inline chip8_op fused_op(chip8_fused_op op)
 {
-	u16 instruction = (ch8->memory[ch8->pc] << 8) | (ch8->memory[ch8->pc + 1]);
-	ch8->pc += 2;
-	return instruction;
+	return (chip8_op)(void (*)(void))op;
 }
 
+static inline u32 run_fused(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	return ((chip8_fused_op)(void (*)(void))insn->handler)(ch8, insn);
+}
 
-extern u8 get_random_byte(void);
+struct chip8_icache {
+	struct chip8_insn entries[MEMORY_SIZE / 2];
+};
 
 /*
- * 0nnn - SYS addr
- * Jump to a machine code routine at nnn.
+ * Statically translated programs.
  *
- * This instruction is only used on the old computers on which Chip-8 was originally implemented. It is ignored by modern interpreters.
+ * tools/c8aot.c translates a ROM into C ahead of time, and the file it writes defines one
+ * chip8_aot. run executes up to n_cycles instructions of the translated program from pc and
+ * returns how many it ran. It stops early, possibly after none, when pc is not the start of a
+ * translated block or too few cycles are left for the next one, and the interpreter takes over
+ * from there. rom and len are the image that was translated. code_pages has a bit for each memory
+ * page holding translated code; a write to any of them detaches the program, because the C no
+ * longer matches the memory it was generated from. quirks is the profile the program was
+ * translated for.
  */
-void instr_0nnn(CHIP8 *ch8, u16 nnn)
+struct chip8_aot {
+	const u8 *rom;
+	u16 len;
+	u16 code_pages;
+	u8 quirks;
+	u32 (*run)(CHIP8 *ch8, u32 n_cycles);
+};
+
+static inline void aot_invalidate(CHIP8 *ch8, u16 addr)
 {
-	(void)ch8;
-	(void)nnn;
+	if (ch8->aot && (ch8->aot->code_pages >> (addr / MEMORY_PAGE_SIZE) & 1)) {
+		ch8->aot = NULL;
+	}
 }
 
-
-/*
- * 00E0 - CLS
- * Clear the display.
- */
-void instr_00e0_cls(CHIP8 *ch8)
+/* Drop the entry holding addr, and any superinstruction starting up to two entries before it. */
+static inline void icache_invalidate(struct chip8_icache *icache, u16 addr)
 {
-	memset(ch8->display, 0, sizeof(ch8->display));
-}
+	u16 i = addr >> 1;
 
+	icache->entries[i].handler = NULL;
+	if (i >= 1 && icache->entries[i - 1].len >= 2) {
+		icache->entries[i - 1].handler = NULL;
+	}
+	if (i >= 2 && icache->entries[i - 2].len >= 3) {
+		icache->entries[i - 2].handler = NULL;
+	}
+}
 
 /*
- * 00EE - RET
- * Return from a subroutine.
+ * Faults.
  *
- * The interpreter sets the program counter to the address at the top of the stack, then subtracts 1 from the stack pointer.
+ * A program can push past the 16-entry stack, return with nothing on it, read sprites past the
+ * end of memory or send pc there. The default build never lets that escape the machine but does
+ * not branch for it either: fetches and memory accesses are masked with MEMORY_SIZE - 1 and the
+ * stack pointer with 0xF, so such a program merely wraps around. With -DCHIP8_CHECKED the same
+ * cases trap instead. The instruction does nothing, ch8->fault records why, and the machine
+ * stops executing until it is cleared; pc is left after the faulting instruction, or at the
+ * address that could not be fetched. A faulted instruction still counts towards cycles. Checked
+ * builds run every instruction through chip8_exec, without the JIT or the computed-goto loop.
  */
-void instr_00ee_ret(CHIP8 *ch8)
+enum chip8_fault {
+	CHIP8_FAULT_NONE,
+	CHIP8_FAULT_STACK_OVERFLOW,
+	CHIP8_FAULT_STACK_UNDERFLOW,
+	CHIP8_FAULT_PC,
+	CHIP8_FAULT_MEMORY,
+};
+
+#ifdef CHIP8_CHECKED
+#define CHIP8_ADDR(addr) (addr)
+#define CHIP8_SP(sp) (sp)
+
+static inline int chip8_trap(CHIP8 *ch8, int cond, enum chip8_fault fault)
+{
+	if (cond) {
+		ch8->fault = fault;
+	}
+	return cond;
+}
+#else
+#define CHIP8_ADDR(addr) ((addr) & (MEMORY_SIZE - 1))
+#define CHIP8_SP(sp) ((sp) & 0xF)
+
+/* Unchecked builds never trap, and the check folds away. */
+static inline int chip8_trap(CHIP8 *ch8, int cond, enum chip8_fault fault)
 {
-	ch8->pc = ch8->stack[ch8->sp];
-	ch8->sp--;
+	(void)ch8;
+	(void)cond;
+	(void)fault;
+	return 0;
 }
+#endif
 
+static inline int chip8_faulted(const CHIP8 *ch8)
+{
+#ifdef CHIP8_CHECKED
+	return ch8->fault != CHIP8_FAULT_NONE;
+#else
+	(void)ch8;
+	return 0;
+#endif
+}
 
 /*
- * 1nnn - JP addr
- * Jump to location nnn.
- *
- * The interpreter sets the program counter to nnn.
+ * The fault ch8 stopped on, CHIP8_FAULT_NONE if it is running. Always CHIP8_FAULT_NONE in
+ * unchecked builds.
  */
-void instr_1nnn_jp_addr(CHIP8 *ch8, u16 nnn)
+enum chip8_fault chip8_fault(const CHIP8 *ch8)
 {
-	ch8->pc = nnn;
+#ifdef CHIP8_CHECKED
+	return ch8->fault;
+#else
+	(void)ch8;
+	return CHIP8_FAULT_NONE;
+#endif
 }
 
-
 /*
- * 2nnn - CALL addr
- * Call subroutine at nnn.
- *
- * The interpreter increments the stack pointer, then puts the current PC on the top of the stack. The PC is then set to nnn.
+ * Clear a fault so that ch8 runs again, typically after the host has fixed up its state.
  */
-void instr_2nnn_call_addr(CHIP8 *ch8, u16 nnn)
+void chip8_clear_fault(CHIP8 *ch8)
 {
-	ch8->sp++;
-	ch8->stack[ch8->sp] = ch8->pc;
-	ch8->pc = nnn;
+#ifdef CHIP8_CHECKED
+	ch8->fault = CHIP8_FAULT_NONE;
+#else
+	(void)ch8;
+#endif
 }
 
+static u16 chip8_fetch(CHIP8 *ch8)
+{
+	u16 instruction = (ch8->memory[CHIP8_ADDR(ch8->pc)] << 8) |
+			  (ch8->memory[CHIP8_ADDR(ch8->pc + 1)]);
+	ch8->pc += 2;
+	return instruction;
+}
 
 /*
- * 3xkk - SE Vx, byte
- * Skip next instruction if Vx = kk.
- *
- * The interpreter compares register Vx to kk, and if they are equal, increments the program counter by 2.
+ * Every store the interpreter does to memory goes through here so that a program overwriting
+ * its own code never runs a stale cached decode.
  */
-void instr_3xkk_se_vx_byte(CHIP8 *ch8, u8 x, u8 kk)
+#ifdef CHIP8_JIT
+static void chip8_jit_invalidate(CHIP8 *ch8, u16 addr);
+#endif
+
+void chip8_write_memory(CHIP8 *ch8, u16 addr, u8 value)
 {
-	if (ch8->V[x] == kk) {
-		ch8->pc += 2;
+	if (chip8_trap(ch8, addr >= MEMORY_SIZE, CHIP8_FAULT_MEMORY)) {
+		return;
 	}
+	addr = CHIP8_ADDR(addr);
+	ch8->memory[addr] = value;
+	ch8->written_pages |= 1u << (addr / MEMORY_PAGE_SIZE);
+	if (ch8->icache) {
+		icache_invalidate(ch8->icache, addr);
+	}
+	aot_invalidate(ch8, addr);
+#ifdef CHIP8_JIT
+	if (ch8->jit) {
+		chip8_jit_invalidate(ch8, addr);
+	}
+#endif
 }
 
-
 /*
- * 4xkk - SNE Vx, byte
- * Skip next instruction if Vx != kk.
+ * Keypad access.
  *
- * The interpreter compares register Vx to kk, and if they are not equal, increments the program counter by 2.
+ * By default the keypad is one byte per key. With CHIP8_PACKED_KEYPAD it is a single u16 with
+ * bit k set while key k is down, updated atomically, so an input thread can call chip8_set_key
+ * while the emulation thread runs and Ex9E, ExA1 and Fx0A check the keys with one load.
  */
-void instr_4xkk_sne_vx_byte(CHIP8 *ch8, u8 x, u8 kk)
+#ifdef CHIP8_PACKED_KEYPAD
+static inline u16 keypad_mask(const CHIP8 *ch8)
 {
-	if (ch8->V[x] != kk) {
-		ch8->pc += 2;
-	}
+	return __atomic_load_n(&ch8->keys, __ATOMIC_ACQUIRE);
 }
 
+static inline void keypad_set_mask(CHIP8 *ch8, u16 mask)
+{
+	__atomic_store_n(&ch8->keys, mask, __ATOMIC_RELEASE);
+}
 
-/*
- * 5xy0 - SE Vx, Vy
- * Skip next instruction if Vx = Vy.
- *
- * The interpreter compares register Vx to register Vy, and if they are equal, increments the program counter by 2.
- */
-void instr_5xy0_se_vx_vy(CHIP8 *ch8, u8 x, u8 y)
+static inline int key_is_down(const CHIP8 *ch8, u8 key)
 {
-	if (ch8->V[x] == ch8->V[y]) {
-		ch8->pc += 2;
+	return (keypad_mask(ch8) >> key) & 1;
+}
+
+/* Returns the key's previous state. */
+static inline int keypad_update(CHIP8 *ch8, u8 key, u8 pressed)
+{
+	u16 bit = (u16)(1u << key);
+	u16 old = pressed ? __atomic_fetch_or(&ch8->keys, bit, __ATOMIC_RELEASE)
+			  : __atomic_fetch_and(&ch8->keys, (u16)~bit, __ATOMIC_RELEASE);
+	return (old & bit) != 0;
+}
+#else
+static inline u16 keypad_mask(const CHIP8 *ch8)
+{
+	u16 mask = 0;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		mask |= (ch8->keypad[i] != 0) << i;
 	}
+	return mask;
 }
 
+static inline void keypad_set_mask(CHIP8 *ch8, u16 mask)
+{
+	int i;
 
-/*
- * 6xkk - LD Vx, byte
- * Set Vx = kk.
- *
- * The interpreter puts the value kk into register Vx.
- */
-void instr_6xkk_ld_vx_byte(CHIP8 *ch8, u8 x, u8 kk)
+	for (i = 0; i < 16; i++) {
+		ch8->keypad[i] = (mask >> i) & 1;
+	}
+}
+
+static inline int key_is_down(const CHIP8 *ch8, u8 key)
 {
-	ch8->V[x] = kk;
+	return ch8->keypad[key] != 0;
 }
 
+static inline int keypad_update(CHIP8 *ch8, u8 key, u8 pressed)
+{
+	int old = ch8->keypad[key] != 0;
+
+	ch8->keypad[key] = pressed;
+	return old;
+}
+#endif
 
 /*
- * 7xkk - ADD Vx, byte
- * Set Vx = Vx + kk.
- *
- * Adds the value kk to the value of register Vx, then stores the result in Vx.
+ * Bitmask of the keys that are currently down, bit k for key k.
  */
-void instr_7xkk_add_vx_byte(CHIP8 *ch8, u8 x, u8 kk)
+u16 chip8_key_mask(const CHIP8 *ch8)
 {
-	ch8->V[x] += kk;
+	return keypad_mask(ch8);
 }
 
-
 /*
- * 8xy0 - LD Vx, Vy
- * Set Vx = Vy.
+ * The display is stored row-major, 1 bit per pixel, with the most significant bit of each byte
+ * being the leftmost pixel. A 64-pixel row is exactly one big-endian u64, which lets DRW work on
+ * whole rows instead of single pixels.
  *
- * Stores the value of register Vy in register Vx.
+ * On GCC and Clang a row is read and written as one u64 load or store plus a byte swap on
+ * little-endian hosts; other compilers go byte by byte. Building with CHIP8_DISPLAY_ROWS64 stores
+ * each row as a native u64 instead, so row accesses need no swap either. Code outside the
+ * interpreter should go through chip8_display_row and chip8_display_byte, which read the same way
+ * in both layouts.
  */
-void instr_8xy0_ld_vx_vy(CHIP8 *ch8, u8 x, u8 y)
+#ifdef CHIP8_DISPLAY_ROWS64
+static inline u64 display_load_row(const CHIP8 *ch8, u8 row)
 {
-	ch8->V[x] = ch8->V[y];
+	return ch8->display[row];
 }
 
-
-/*
- * 8xy1 - OR Vx, Vy
- * Set Vx = Vx OR Vy.
- *
- * Performs a bitwise OR on the values of Vx and Vy, then stores the result in Vx.
- * A bitwise OR compares the corrseponding bits from two values, and if either bit is 1,
- * then the same bit in the result is also 1. Otherwise, it is 0.
- */
-void instr_8xy1_or_vx_vy(CHIP8 *ch8, u8 x, u8 y)
+static inline void display_store_row(CHIP8 *ch8, u8 row, u64 bits)
 {
-	ch8->V[x] |= ch8->V[y];
+	ch8->display[row] = bits;
+}
+#elif (defined(__GNUC__) || defined(__clang__)) && defined(__BYTE_ORDER__)
+static inline u64 display_be64(u64 bits)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	return __builtin_bswap64(bits);
+#else
+	return bits;
+#endif
 }
 
+static inline u64 display_load_row(const CHIP8 *ch8, u8 row)
+{
+	u64 bits;
+
+	memcpy(&bits, &ch8->display[row * (DISPLAY_LENGTH / 8)], sizeof(bits));
+	return display_be64(bits);
+}
 
-/*
- * 8xy2 - AND Vx, Vy
- * Set Vx = Vx AND Vy.
- *
- * Performs a bitwise AND on the values of Vx and Vy, then stores the result in Vx.
- * A bitwise AND compares the corrseponding bits from two values, and if both bits are 1,
- * then the same bit in the result is also 1. Otherwise, it is 0.
- */
-void instr_8xy2_and_vx_vy(CHIP8 *ch8, u8 x, u8 y)
+static inline void display_store_row(CHIP8 *ch8, u8 row, u64 bits)
 {
-	ch8->V[x] &= ch8->V[y];
+	bits = display_be64(bits);
+	memcpy(&ch8->display[row * (DISPLAY_LENGTH / 8)], &bits, sizeof(bits));
 }
+#else
+static inline u64 display_load_row(const CHIP8 *ch8, u8 row)
+{
+	const u8 *p = &ch8->display[row * (DISPLAY_LENGTH / 8)];
+	u64 bits = 0;
+	int i;
 
+	for (i = 0; i < DISPLAY_LENGTH / 8; i++) {
+		bits = (bits << 8) | p[i];
+	}
+	return bits;
+}
 
-/*
- * 8xy3 - XOR Vx, Vy
- * Set Vx = Vx XOR Vy.
- *
- * Performs a bitwise exclusive OR on the values of Vx and Vy, then stores the result in Vx.
- * An exclusive OR compares the corrseponding bits from two values, and if the bits are not both the same,
- * then the corresponding bit in the result is set to 1. Otherwise, it is 0.
- */
-void instr_8xy3_xor_vx_vy(CHIP8 *ch8, u8 x, u8 y)
+static inline void display_store_row(CHIP8 *ch8, u8 row, u64 bits)
 {
-	ch8->V[x] ^= ch8->V[y];
-}
+	u8 *p = &ch8->display[row * (DISPLAY_LENGTH / 8)];
+	int i;
 
+	for (i = DISPLAY_LENGTH / 8 - 1; i >= 0; i--) {
+		p[i] = (u8)bits;
+		bits >>= 8;
+	}
+}
+#endif
 
 /*
- * 8xy4 - ADD Vx, Vy
- * Set Vx = Vx + Vy, set VF = carry.
- *
- * The values of Vx and Vy are added together. If the result is greater than 8 bits (i.e., > 255,) VF is set to 1, otherwise 0.
- * Only the lowest 8 bits of the result are kept, and stored in Vx.
+ * Row y of the display, leftmost pixel in the most significant bit.
  */
-void instr_8xy4_add_vx_vy(CHIP8 *ch8, u8 x, u8 y)
+u64 chip8_display_row(const CHIP8 *ch8, u8 y)
 {
-	u16 sum = ch8->V[x] + ch8->V[y];
-	ch8->V[0xF] = sum  > 255;
-	ch8->V[x] = (u8)sum;
+	return display_load_row(ch8, y);
 }
 
-
 /*
- * 8xy5 - SUB Vx, Vy
- * Set Vx = Vx - Vy, set VF = NOT borrow.
- *
- * If Vx > Vy, then VF is set to 1, otherwise 0. Then Vy is subtracted from Vx, and the results stored in Vx.
+ * Byte i of the packed display as laid out by the default byte-array layout: 8 pixels per byte,
+ * DISPLAY_LENGTH / 8 bytes per row, most significant bit first.
  */
-void instr_8xy5_sub_vx_vy(CHIP8 *ch8, u8 x, u8 y)
+u8 chip8_display_byte(const CHIP8 *ch8, u16 i)
 {
-	ch8->V[0xF] = ch8->V[x] > ch8->V[y];
-	ch8->V[x] -= ch8->V[y];
+	u64 bits = display_load_row(ch8, i / (DISPLAY_LENGTH / 8));
+	return (u8)(bits >> (8 * (DISPLAY_LENGTH / 8 - 1 - i % (DISPLAY_LENGTH / 8))));
 }
 
-
 /*
- * 8xy6 - SHR Vx {, Vy}
- * Set Vx = Vx SHR 1.
- *
- * If the least-significant bit of Vx is 1, then VF is set to 1, otherwise 0. Then Vx is divided by 2.
+ * Copy the display out in the packed byte layout, DISPLAY_HEIGHT * DISPLAY_LENGTH / 8 bytes.
  */
-void instr_8xy6_shr_vx(CHIP8 *ch8, u8 x)
+void chip8_display_read(const CHIP8 *ch8, u8 *out)
 {
-	ch8->V[0xF] = ch8->V[x] & 0x01;
-	ch8->V[x] >>= 1;
-}
+	u8 row;
+	int i;
 
+	for (row = 0; row < DISPLAY_HEIGHT; row++) {
+		u64 bits = display_load_row(ch8, row);
+
+		for (i = DISPLAY_LENGTH / 8 - 1; i >= 0; i--) {
+			out[row * (DISPLAY_LENGTH / 8) + i] = (u8)bits;
+			bits >>= 8;
+		}
+	}
+}
 
 /*
- * 8xy7 - SUBN Vx, Vy
- * Set Vx = Vy - Vx, set VF = NOT borrow.
+ * SUPER-CHIP hi-res mode.
  *
- * If Vy > Vx, then VF is set to 1, otherwise 0. Then Vx is subtracted from Vy, and the results stored in Vx.
+ * Under CHIP8_QUIRKS_SCHIP, 00FF switches a machine to a 128x64 display and 00FE back to the
+ * 64x32 one. The hi-res display is kept in hires_display, apart from display, with every row as
+ * two u64: the left 64 pixels in the first, the right 64 in the second, leftmost pixel in the
+ * most significant bit. A pixel run that crosses the middle is a shift across the pair,
+ * scrolling sideways is two word shifts per row and scrolling down is one memmove.
+ *
+ * While hires is set CLS, DRW and the scroll instructions work on hires_display and keep
+ * hires_dirty_rows up to date, one bit per row. The chip8_display_* accessors above always read
+ * the 64x32 display.
+ *
+ * Most ROMs never leave the 64x32 display, so the 1 KB hi-res display is kept at the end of
+ * CHIP8, out of what chip8_reset copies and what an instance holds, and it only means anything
+ * while hires is set: switching to hi-res clears it, and everything that saves a machine keeps
+ * it only for a machine in hi-res.
  */
-void instr_8xy7_subn_vx_vy(CHIP8 *ch8, u8 x, u8 y)
+
+/*
+ * Whether ch8 is in hi-res mode.
+ */
+int chip8_display_hires(const CHIP8 *ch8)
 {
-	ch8->V[0xF] = ch8->V[y] > ch8->V[x];
-	ch8->V[x] = ch8->V[y] - ch8->V[x];
+	return ch8->hires;
 }
 
-
 /*
- * 8xyE - SHL Vx {, Vy}
- * Set Vx = Vx SHL 1.
- *
- * If the most-significant bit of Vx is 1, then VF is set to 1, otherwise to 0. Then Vx is multiplied by 2.
+ * Row y of the hi-res display: out[0] holds pixels 0-63, out[1] pixels 64-127.
  */
-void instr_8xye_shl_vx(CHIP8 *ch8, u8 x)
+void chip8_hires_row(const CHIP8 *ch8, u8 y, u64 *out)
 {
-	ch8->V[0xF] = (ch8->V[x] >> 7) & 0x01;
-	ch8->V[x] <<= 1;
+	out[0] = ch8->hires_display[y][0];
+	out[1] = ch8->hires_display[y][1];
 }
 
-
 /*
- * 9xy0 - SNE Vx, Vy
- * Skip next instruction if Vx != Vy.
+ * Changed-row tracking.
  *
- * The values of Vx and Vy are compared, and if they are not equal, the program counter is increased by 2.
+ * Bit r of dirty_rows is set whenever CLS, DRW or a scroll changes row r. chip8_frame_diff hands
+ * out the rows that changed since the previous call and starts a new frame, so a frontend or a
+ * remote viewer only has to push those rows. chip8_hires_frame_diff does the same for the hi-res
+ * display and hires_dirty_rows, and hands out nothing in lo-res mode. Switching modes marks every
+ * row of both displays.
  */
-void instr_9xy0_sne_vx_vy(CHIP8 *ch8, u8 x, u8 y)
+struct chip8_row_update {
+	u8 row;
+	u64 bits;
+};
+
+struct chip8_hires_row_update {
+	u8 row;
+	u64 bits[2];
+};
+
+static inline int ctz32(u32 v)
 {
-	if (ch8->V[x] != ch8->V[y]) {
-		ch8->pc += 2;
+#if defined(__GNUC__) || defined(__clang__)
+	return __builtin_ctz(v);
+#else
+	int n = 0;
+
+	while (!(v & 1)) {
+		v >>= 1;
+		n++;
 	}
+	return n;
+#endif
 }
 
+static inline int ctz64(u64 v)
+{
+	return (u32)v ? ctz32((u32)v) : 32 + ctz32((u32)(v >> 32));
+}
 
 /*
- * Annn - LD I, addr
- * Set I = nnn.
- *
- * The value of register I is set to nnn.
+ * Fill out[] with the rows changed since the last call and return how many there are. out must
+ * have room for DISPLAY_HEIGHT entries. Passing NULL just starts a new frame.
  */
-void instr_annn_ld_i_addr(CHIP8 *ch8, u16 nnn)
+u8 chip8_frame_diff(CHIP8 *ch8, struct chip8_row_update *out)
 {
-	ch8->I = nnn;
+	u32 dirty = ch8->dirty_rows;
+	u8 count = 0;
+
+	ch8->dirty_rows = 0;
+	if (!out) {
+		return 0;
+	}
+	while (dirty) {
+		u8 row = ctz32(dirty);
+
+		out[count].row = row;
+		out[count].bits = display_load_row(ch8, row);
+		count++;
+		dirty &= dirty - 1;
+	}
+	return count;
+}
+
+/*
+ * chip8_frame_diff for the hi-res display. out must have room for DISPLAY_HIRES_HEIGHT entries.
+ */
+u8 chip8_hires_frame_diff(CHIP8 *ch8, struct chip8_hires_row_update *out)
+{
+	u64 dirty = ch8->hires_dirty_rows;
+	u8 count = 0;
+
+	ch8->hires_dirty_rows = 0;
+	if (!out || !ch8->hires) {
+		return 0;
+	}
+	while (dirty) {
+		u8 row = ctz64(dirty);
+
+		out[count].row = row;
+		chip8_hires_row(ch8, row, out[count].bits);
+		count++;
+		dirty &= dirty - 1;
+	}
+	return count;
+}
+
+/*
+ * Framebuffer expansion.
+ *
+ * chip8_expand_display converts the 1bpp display into a caller-owned surface, scaled by an
+ * integer factor. The on and off colours are given as raw pixel values of the target format
+ * (host-order u32 for RGBA8, u16 for RGB565, u8 for L8).
+ *
+ * Rows are expanded 64 pixels at a time, 8 or 16 per vector with AVX2 (RGBA8 only, the other
+ * formats use the SSE2 kernel the target also has), SSE2 or NEON, whichever the build targets,
+ * or bit by bit otherwise. At higher scales each row is first widened to scale bits per pixel,
+ * which then go through the same kernel, and the first output line is copied to the other
+ * scale - 1 lines, so every store is a vector store or a memcpy of a whole line.
+ */
+enum chip8_pixel_format {
+	CHIP8_PIXEL_RGBA8,
+	CHIP8_PIXEL_RGB565,
+	CHIP8_PIXEL_L8,
+};
+
+struct chip8_surface {
+	void *pixels;
+	u32 pitch;
+	enum chip8_pixel_format format;
+	u32 on;
+	u32 off;
+	u8 scale;
+};
+
+#define CHIP8_MAX_SCALE 16
+
+static u8 pixel_size(enum chip8_pixel_format format)
+{
+	switch (format) {
+	case CHIP8_PIXEL_RGBA8:
+		return 4;
+	case CHIP8_PIXEL_RGB565:
+		return 2;
+	default:
+		return 1;
+	}
+}
+
+static inline void put_pixel(u8 *dst, enum chip8_pixel_format format, u32 value)
+{
+	u16 v16 = (u16)value;
+	u8 v8 = (u8)value;
+
+	switch (format) {
+	case CHIP8_PIXEL_RGBA8:
+		memcpy(dst, &value, 4);
+		break;
+	case CHIP8_PIXEL_RGB565:
+		memcpy(dst, &v16, 2);
+		break;
+	default:
+		memcpy(dst, &v8, 1);
+		break;
+	}
+}
+
+#if !(defined(__SSE2__) || defined(__ARM_NEON))
+static void expand_row_scalar(u64 bits, u8 *dst, enum chip8_pixel_format format, u32 on, u32 off)
+{
+	u8 size = pixel_size(format);
+	int i;
+
+	for (i = 0; i < DISPLAY_LENGTH; i++) {
+		put_pixel(dst + i * size, format, (bits >> (DISPLAY_LENGTH - 1 - i)) & 1 ? on : off);
+	}
+}
+#endif
+
+#if defined(__SSE2__)
+static inline __m128i sse2_select(__m128i mask, __m128i on, __m128i off)
+{
+	return _mm_or_si128(_mm_and_si128(mask, on), _mm_andnot_si128(mask, off));
+}
+
+static void expand_row_sse2(u64 bits, u8 *dst, enum chip8_pixel_format format, u32 on, u32 off)
+{
+	const __m128i select = _mm_setr_epi8((char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+					     (char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+	int i;
+
+	/* Two bytes of the row give 16 mask bytes, which are widened to the pixel size. */
+	for (i = 0; i < DISPLAY_LENGTH / 16; i++) {
+		u16 pair = (u16)(bits >> (DISPLAY_LENGTH - 16 - 16 * i));
+		__m128i b = _mm_cvtsi32_si128(((pair >> 8) & 0xFF) | ((pair & 0xFF) << 8));
+		__m128i mask;
+
+		b = _mm_unpacklo_epi8(b, b);
+		b = _mm_unpacklo_epi16(b, b);
+		b = _mm_unpacklo_epi32(b, b);
+		mask = _mm_cmpeq_epi8(_mm_and_si128(b, select), select);
+
+		if (format == CHIP8_PIXEL_L8) {
+			_mm_storeu_si128((__m128i *)(dst + 16 * i),
+					 sse2_select(mask, _mm_set1_epi8((char)on), _mm_set1_epi8((char)off)));
+		} else if (format == CHIP8_PIXEL_RGB565) {
+			__m128i von = _mm_set1_epi16((short)on);
+			__m128i voff = _mm_set1_epi16((short)off);
+			u8 *p = dst + 32 * i;
+
+			_mm_storeu_si128((__m128i *)p, sse2_select(_mm_unpacklo_epi8(mask, mask), von, voff));
+			_mm_storeu_si128((__m128i *)(p + 16), sse2_select(_mm_unpackhi_epi8(mask, mask), von, voff));
+		} else {
+			__m128i von = _mm_set1_epi32((int)on);
+			__m128i voff = _mm_set1_epi32((int)off);
+			__m128i lo = _mm_unpacklo_epi8(mask, mask);
+			__m128i hi = _mm_unpackhi_epi8(mask, mask);
+			u8 *p = dst + 64 * i;
+
+			_mm_storeu_si128((__m128i *)p, sse2_select(_mm_unpacklo_epi16(lo, lo), von, voff));
+			_mm_storeu_si128((__m128i *)(p + 16), sse2_select(_mm_unpackhi_epi16(lo, lo), von, voff));
+			_mm_storeu_si128((__m128i *)(p + 32), sse2_select(_mm_unpacklo_epi16(hi, hi), von, voff));
+			_mm_storeu_si128((__m128i *)(p + 48), sse2_select(_mm_unpackhi_epi16(hi, hi), von, voff));
+		}
+	}
+}
+#endif
+
+#if defined(__AVX2__)
+static void expand_row(u64 bits, u8 *dst, enum chip8_pixel_format format, u32 on, u32 off)
+{
+	const __m256i select = _mm256_setr_epi32(0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+	const __m256i von = _mm256_set1_epi32((int)on);
+	const __m256i voff = _mm256_set1_epi32((int)off);
+	int i;
+
+	if (format != CHIP8_PIXEL_RGBA8) {
+		expand_row_sse2(bits, dst, format, on, off);
+		return;
+	}
+	/* One byte of the row is 8 lanes of 32-bit pixels. */
+	for (i = 0; i < DISPLAY_LENGTH / 8; i++) {
+		__m256i b = _mm256_set1_epi32((int)((bits >> (DISPLAY_LENGTH - 8 - 8 * i)) & 0xFF));
+		__m256i mask = _mm256_cmpeq_epi32(_mm256_and_si256(b, select), select);
+
+		_mm256_storeu_si256((__m256i *)(dst + 32 * i), _mm256_blendv_epi8(voff, von, mask));
+	}
+}
+#elif defined(__SSE2__)
+static void expand_row(u64 bits, u8 *dst, enum chip8_pixel_format format, u32 on, u32 off)
+{
+	expand_row_sse2(bits, dst, format, on, off);
+}
+#elif defined(__ARM_NEON)
+static void expand_row(u64 bits, u8 *dst, enum chip8_pixel_format format, u32 on, u32 off)
+{
+	static const u8 select_bits[8] = { 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01 };
+	const uint8x8_t select = vld1_u8(select_bits);
+	int i;
+
+	/* One byte of the row is 8 mask bytes; vmovl of the signed mask widens 0xFF to all ones. */
+	for (i = 0; i < DISPLAY_LENGTH / 8; i++) {
+		uint8x8_t b = vdup_n_u8((u8)(bits >> (DISPLAY_LENGTH - 8 - 8 * i)));
+		uint8x8_t mask = vtst_u8(b, select);
+
+		if (format == CHIP8_PIXEL_L8) {
+			vst1_u8(dst + 8 * i, vbsl_u8(mask, vdup_n_u8((u8)on), vdup_n_u8((u8)off)));
+		} else {
+			int16x8_t m16 = vmovl_s8(vreinterpret_s8_u8(mask));
+
+			if (format == CHIP8_PIXEL_RGB565) {
+				vst1q_u16((u16 *)(dst + 16 * i), vbslq_u16(vreinterpretq_u16_s16(m16),
+						 vdupq_n_u16((u16)on), vdupq_n_u16((u16)off)));
+			} else {
+				uint32x4_t lo = vreinterpretq_u32_s32(vmovl_s16(vget_low_s16(m16)));
+				uint32x4_t hi = vreinterpretq_u32_s32(vmovl_s16(vget_high_s16(m16)));
+
+				vst1q_u32((u32 *)(dst + 32 * i), vbslq_u32(lo, vdupq_n_u32(on), vdupq_n_u32(off)));
+				vst1q_u32((u32 *)(dst + 32 * i + 16), vbslq_u32(hi, vdupq_n_u32(on), vdupq_n_u32(off)));
+			}
+		}
+	}
+}
+#else
+static void expand_row(u64 bits, u8 *dst, enum chip8_pixel_format format, u32 on, u32 off)
+{
+	expand_row_scalar(bits, dst, format, on, off);
+}
+#endif
+
+/* Every bit of half doubled, in the same order. */
+static inline u64 double_bits(u32 half)
+{
+	u64 x = half;
+
+	x = (x | x << 16) & 0x0000FFFF0000FFFFull;
+	x = (x | x << 8) & 0x00FF00FF00FF00FFull;
+	x = (x | x << 4) & 0x0F0F0F0F0F0F0F0Full;
+	x = (x | x << 2) & 0x3333333333333333ull;
+	x = (x | x << 1) & 0x5555555555555555ull;
+	return x | x << 1;
+}
+
+/*
+ * Widen the 64 pixels of bits to scale bits each, into the scale words of out, leftmost pixel
+ * in the most significant bit of out[0]. Powers of two double every bit log2(scale) times; other
+ * scales place a run of scale bits per lit pixel.
+ */
+static void widen_bits(u64 bits, u8 scale, u64 *out)
+{
+	u64 run = ~(u64)0 << (64 - scale);
+	u32 pos;
+	u8 n;
+
+	if ((scale & (scale - 1)) == 0) {
+		out[0] = bits;
+		for (n = 1; n < scale; n *= 2) {
+			u8 i = n;
+
+			while (i--) {
+				u64 w = out[i];
+
+				out[2 * i] = double_bits((u32)(w >> 32));
+				out[2 * i + 1] = double_bits((u32)w);
+			}
+		}
+		return;
+	}
+	memset(out, 0, scale * sizeof(*out));
+	while (bits) {
+		pos = (u32)(63 - ctz64(bits)) * scale;
+		out[pos / 64] |= run >> (pos % 64);
+		if (pos % 64 + scale > 64) {
+			out[pos / 64 + 1] |= run << (64 - pos % 64);
+		}
+		bits &= bits - 1;
+	}
+}
+
+/*
+ * Expand height rows of words 64-pixel words each into dst. bits[row][w] is word w of the row,
+ * leftmost pixel in the most significant bit.
+ */
+static int expand_words(const struct chip8_surface *dst, const u64 (*bits)[2], u8 height, u8 words)
+{
+	u64 wide[2 * CHIP8_MAX_SCALE];
+	u8 size = pixel_size(dst->format);
+	u8 scale = dst->scale;
+	u32 width = (u32)words * DISPLAY_LENGTH * scale * size;
+	u8 *line = dst->pixels;
+	u8 row;
+	u8 w;
+	u8 i;
+
+	if (scale == 0 || scale > CHIP8_MAX_SCALE) {
+		return -1;
+	}
+	if (scale == 1) {
+		for (row = 0; row < height; row++, line += dst->pitch) {
+			for (w = 0; w < words; w++) {
+				expand_row(bits[row][w], line + w * DISPLAY_LENGTH * size, dst->format,
+					   dst->on, dst->off);
+			}
+		}
+		return 0;
+	}
+
+	for (row = 0; row < height; row++) {
+		for (w = 0; w < words; w++) {
+			widen_bits(bits[row][w], scale, wide + w * scale);
+		}
+		for (i = 0; i < words * scale; i++) {
+			expand_row(wide[i], line + i * DISPLAY_LENGTH * size, dst->format, dst->on,
+				   dst->off);
+		}
+		for (i = 1; i < scale; i++) {
+			memcpy(line + i * dst->pitch, line, width);
+		}
+		line += scale * dst->pitch;
+	}
+	return 0;
+}
+
+/*
+ * Expand the display into dst. The surface must be at least DISPLAY_LENGTH * scale pixels wide
+ * and DISPLAY_HEIGHT * scale lines high, or DISPLAY_HIRES_LENGTH * scale by
+ * DISPLAY_HIRES_HEIGHT * scale in hi-res mode, lines pitch bytes apart. Returns 0 on success and
+ * -1 if scale is outside 1..CHIP8_MAX_SCALE.
+ */
+int chip8_expand_display(const CHIP8 *ch8, const struct chip8_surface *dst)
+{
+	u64 rows[DISPLAY_HEIGHT][2];
+	u8 row;
+
+	if (ch8->hires) {
+		return expand_words(dst, (const u64 (*)[2])ch8->hires_display, DISPLAY_HIRES_HEIGHT, 2);
+	}
+	for (row = 0; row < DISPLAY_HEIGHT; row++) {
+		rows[row][0] = display_load_row(ch8, row);
+	}
+	return expand_words(dst, (const u64 (*)[2])rows, DISPLAY_HEIGHT, 1);
+}
+
+/*
+ * 64-bit FNV-1a hash of the display, one round per row, or per half row in hi-res mode. The
+ * result does not depend on the display layout, so golden frame hashes can be shared between
+ * builds.
+ */
+u64 chip8_display_hash(const CHIP8 *ch8)
+{
+	u64 hash = 0xCBF29CE484222325ull;
+	u8 row;
+
+	if (ch8->hires) {
+		for (row = 0; row < DISPLAY_HIRES_HEIGHT; row++) {
+			hash ^= ch8->hires_display[row][0];
+			hash *= 0x100000001B3ull;
+			hash ^= ch8->hires_display[row][1];
+			hash *= 0x100000001B3ull;
+		}
+		return hash;
+	}
+	for (row = 0; row < DISPLAY_HEIGHT; row++) {
+		hash ^= display_load_row(ch8, row);
+		hash *= 0x100000001B3ull;
+	}
+	return hash;
+}
+
+static inline u64 rotr64(u64 bits, u8 n)
+{
+	return (bits >> n) | (bits << ((64 - n) & 63));
+}
+
+/* Rotate the 128-bit value hi:lo right by n, below 128. */
+static inline void rotr128(u64 *hi, u64 *lo, u8 n)
+{
+	u64 h = *hi;
+	u64 l = *lo;
+
+	if (n & 64) {
+		h = *lo;
+		l = *hi;
+	}
+	n &= 63;
+	*hi = n ? (h >> n) | (l << (64 - n)) : h;
+	*lo = n ? (l >> n) | (h << (64 - n)) : l;
+}
+
+/*
+ * RND draws from a PCG32 generator whose state lives in struct chip8, so every machine has its
+ * own reproducible sequence and machines on different threads share nothing. Any state value,
+ * zero included, is valid. Building with CHIP8_EXTERN_RANDOM routes RND to an external
+ * get_random_byte instead.
+ */
+#ifdef CHIP8_EXTERN_RANDOM
+extern u8 get_random_byte(void);
+#endif
+
+void chip8_seed(CHIP8 *ch8, u64 seed)
+{
+	ch8->rng_state = seed;
+}
+
+static inline u8 chip8_random_byte(CHIP8 *ch8)
+{
+#ifdef CHIP8_EXTERN_RANDOM
+	(void)ch8;
+	return get_random_byte();
+#else
+	u64 old = ch8->rng_state;
+	u32 xorshifted = (u32)(((old >> 18) ^ old) >> 27);
+	u32 rot = (u32)(old >> 59);
+
+	ch8->rng_state = old * 6364136223846793005ull + 1442695040888963407ull;
+	return (u8)(((xorshifted >> rot) | (xorshifted << ((32 - rot) & 31))) >> 24);
+#endif
+}
+
+/*
+ * 0nnn - SYS addr
+ * Jump to a machine code routine at nnn.
+ *
+ * This instruction is only used on the old computers on which Chip-8 was originally implemented. It is ignored by modern interpreters.
+ */
+void instr_0nnn(CHIP8 *ch8, u16 nnn)
+{
+	(void)ch8;
+	(void)nnn;
+}
+
+
+/*
+ * 00E0 - CLS
+ * Clear the display.
+ */
+void instr_00e0_cls(CHIP8 *ch8)
+{
+	u8 row;
+
+	if (ch8->hires) {
+		for (row = 0; row < DISPLAY_HIRES_HEIGHT; row++) {
+			if (ch8->hires_display[row][0] | ch8->hires_display[row][1]) {
+				ch8->hires_dirty_rows |= (u64)1 << row;
+			}
+		}
+		memset(ch8->hires_display, 0, sizeof(ch8->hires_display));
+		return;
+	}
+	for (row = 0; row < DISPLAY_HEIGHT; row++) {
+		if (display_load_row(ch8, row)) {
+			ch8->dirty_rows |= (u32)1 << row;
+		}
+	}
+	memset(ch8->display, 0, sizeof(ch8->display));
+}
+
+
+/*
+ * 00EE - RET
+ * Return from a subroutine.
+ *
+ * The interpreter sets the program counter to the address at the top of the stack, then subtracts 1 from the stack pointer.
+ */
+void instr_00ee_ret(CHIP8 *ch8)
+{
+	if (chip8_trap(ch8, ch8->sp == 0, CHIP8_FAULT_STACK_UNDERFLOW)) {
+		return;
+	}
+	ch8->pc = ch8->stack[CHIP8_SP(ch8->sp)];
+	ch8->sp = CHIP8_SP(ch8->sp - 1);
+}
+
+
+/*
+ * 1nnn - JP addr
+ * Jump to location nnn.
+ *
+ * The interpreter sets the program counter to nnn.
+ */
+void instr_1nnn_jp_addr(CHIP8 *ch8, u16 nnn)
+{
+	ch8->pc = nnn;
+}
+
+
+/*
+ * 2nnn - CALL addr
+ * Call subroutine at nnn.
+ *
+ * The interpreter increments the stack pointer, then puts the current PC on the top of the stack. The PC is then set to nnn.
+ */
+void instr_2nnn_call_addr(CHIP8 *ch8, u16 nnn)
+{
+	if (chip8_trap(ch8, ch8->sp >= 15, CHIP8_FAULT_STACK_OVERFLOW)) {
+		return;
+	}
+	ch8->sp = CHIP8_SP(ch8->sp + 1);
+	ch8->stack[ch8->sp] = ch8->pc;
+	ch8->pc = nnn;
+}
+
+
+/*
+ * 3xkk - SE Vx, byte
+ * Skip next instruction if Vx = kk.
+ *
+ * The interpreter compares register Vx to kk, and if they are equal, increments the program counter by 2.
+ */
+void instr_3xkk_se_vx_byte(CHIP8 *ch8, u8 x, u8 kk)
+{
+	if (ch8->V[x] == kk) {
+		ch8->pc += 2;
+	}
+}
+
+
+/*
+ * 4xkk - SNE Vx, byte
+ * Skip next instruction if Vx != kk.
+ *
+ * The interpreter compares register Vx to kk, and if they are not equal, increments the program counter by 2.
+ */
+void instr_4xkk_sne_vx_byte(CHIP8 *ch8, u8 x, u8 kk)
+{
+	if (ch8->V[x] != kk) {
+		ch8->pc += 2;
+	}
+}
+
+
+/*
+ * 5xy0 - SE Vx, Vy
+ * Skip next instruction if Vx = Vy.
+ *
+ * The interpreter compares register Vx to register Vy, and if they are equal, increments the program counter by 2.
+ */
+void instr_5xy0_se_vx_vy(CHIP8 *ch8, u8 x, u8 y)
+{
+	if (ch8->V[x] == ch8->V[y]) {
+		ch8->pc += 2;
+	}
+}
+
+
+/*
+ * 6xkk - LD Vx, byte
+ * Set Vx = kk.
+ *
+ * The interpreter puts the value kk into register Vx.
+ */
+void instr_6xkk_ld_vx_byte(CHIP8 *ch8, u8 x, u8 kk)
+{
+	ch8->V[x] = kk;
+}
+
+
+/*
+ * 7xkk - ADD Vx, byte
+ * Set Vx = Vx + kk.
+ *
+ * Adds the value kk to the value of register Vx, then stores the result in Vx.
+ */
+void instr_7xkk_add_vx_byte(CHIP8 *ch8, u8 x, u8 kk)
+{
+	ch8->V[x] += kk;
+}
+
+
+/*
+ * 8xy0 - LD Vx, Vy
+ * Set Vx = Vy.
+ *
+ * Stores the value of register Vy in register Vx.
+ */
+void instr_8xy0_ld_vx_vy(CHIP8 *ch8, u8 x, u8 y)
+{
+	ch8->V[x] = ch8->V[y];
+}
+
+
+/*
+ * 8xy1 - OR Vx, Vy
+ * Set Vx = Vx OR Vy.
+ *
+ * Performs a bitwise OR on the values of Vx and Vy, then stores the result in Vx.
+ * A bitwise OR compares the corrseponding bits from two values, and if either bit is 1,
+ * then the same bit in the result is also 1. Otherwise, it is 0.
+ */
+void instr_8xy1_or_vx_vy(CHIP8 *ch8, u8 x, u8 y)
+{
+	ch8->V[x] |= ch8->V[y];
+}
+
+
+/*
+ * 8xy2 - AND Vx, Vy
+ * Set Vx = Vx AND Vy.
+ *
+ * Performs a bitwise AND on the values of Vx and Vy, then stores the result in Vx.
+ * A bitwise AND compares the corrseponding bits from two values, and if both bits are 1,
+ * then the same bit in the result is also 1. Otherwise, it is 0.
+ */
+void instr_8xy2_and_vx_vy(CHIP8 *ch8, u8 x, u8 y)
+{
+	ch8->V[x] &= ch8->V[y];
+}
+
+
+/*
+ * 8xy3 - XOR Vx, Vy
+ * Set Vx = Vx XOR Vy.
+ *
+ * Performs a bitwise exclusive OR on the values of Vx and Vy, then stores the result in Vx.
+ * An exclusive OR compares the corrseponding bits from two values, and if the bits are not both the same,
+ * then the corresponding bit in the result is set to 1. Otherwise, it is 0.
+ */
+void instr_8xy3_xor_vx_vy(CHIP8 *ch8, u8 x, u8 y)
+{
+	ch8->V[x] ^= ch8->V[y];
+}
+
+
+/*
+ * 8xy4 - ADD Vx, Vy
+ * Set Vx = Vx + Vy, set VF = carry.
+ *
+ * The values of Vx and Vy are added together. If the result is greater than 8 bits (i.e., > 255,) VF is set to 1, otherwise 0.
+ * Only the lowest 8 bits of the result are kept, and stored in Vx.
+ */
+void instr_8xy4_add_vx_vy(CHIP8 *ch8, u8 x, u8 y)
+{
+	u16 sum = ch8->V[x] + ch8->V[y];
+	ch8->V[0xF] = sum  > 255;
+	ch8->V[x] = (u8)sum;
+}
+
+
+/*
+ * 8xy5 - SUB Vx, Vy
+ * Set Vx = Vx - Vy, set VF = NOT borrow.
+ *
+ * If Vx > Vy, then VF is set to 1, otherwise 0. Then Vy is subtracted from Vx, and the results stored in Vx.
+ */
+void instr_8xy5_sub_vx_vy(CHIP8 *ch8, u8 x, u8 y)
+{
+	ch8->V[0xF] = ch8->V[x] > ch8->V[y];
+	ch8->V[x] -= ch8->V[y];
+}
+
+
+/*
+ * 8xy6 - SHR Vx {, Vy}
+ * Set Vx = Vx SHR 1.
+ *
+ * If the least-significant bit of Vx is 1, then VF is set to 1, otherwise 0. Then Vx is divided by 2.
+ */
+void instr_8xy6_shr_vx(CHIP8 *ch8, u8 x)
+{
+	ch8->V[0xF] = ch8->V[x] & 0x01;
+	ch8->V[x] >>= 1;
+}
+
+
+/*
+ * 8xy7 - SUBN Vx, Vy
+ * Set Vx = Vy - Vx, set VF = NOT borrow.
+ *
+ * If Vy > Vx, then VF is set to 1, otherwise 0. Then Vx is subtracted from Vy, and the results stored in Vx.
+ */
+void instr_8xy7_subn_vx_vy(CHIP8 *ch8, u8 x, u8 y)
+{
+	ch8->V[0xF] = ch8->V[y] > ch8->V[x];
+	ch8->V[x] = ch8->V[y] - ch8->V[x];
+}
+
+
+/*
+ * 8xyE - SHL Vx {, Vy}
+ * Set Vx = Vx SHL 1.
+ *
+ * If the most-significant bit of Vx is 1, then VF is set to 1, otherwise to 0. Then Vx is multiplied by 2.
+ */
+void instr_8xye_shl_vx(CHIP8 *ch8, u8 x)
+{
+	ch8->V[0xF] = (ch8->V[x] >> 7) & 0x01;
+	ch8->V[x] <<= 1;
+}
+
+
+/*
+ * 9xy0 - SNE Vx, Vy
+ * Skip next instruction if Vx != Vy.
+ *
+ * The values of Vx and Vy are compared, and if they are not equal, the program counter is increased by 2.
+ */
+void instr_9xy0_sne_vx_vy(CHIP8 *ch8, u8 x, u8 y)
+{
+	if (ch8->V[x] != ch8->V[y]) {
+		ch8->pc += 2;
+	}
+}
+
+
+/*
+ * Annn - LD I, addr
+ * Set I = nnn.
+ *
+ * The value of register I is set to nnn.
+ */
+void instr_annn_ld_i_addr(CHIP8 *ch8, u16 nnn)
+{
+	ch8->I = nnn;
+}
+
+
+/*
+ * Bnnn - JP V0, addr
+ * Jump to location nnn + V0.
+ *
+ * The program counter is set to nnn plus the value of V0.
+ */
+void instr_bnnn_jp_v0_addr(CHIP8 *ch8, u16 nnn)
+{
+	ch8->pc = CHIP8_ADDR(nnn + ch8->V[0x0]);
+}
+
+
+/*
+ * Cxkk - RND Vx, byte
+ * Set Vx = random byte AND kk.
+ *
+ * The interpreter generates a random number from 0 to 255, which is then ANDed with the value kk. The results are stored in Vx. See instruction 8xy2 for more information on AND.
+ */
+void cxkk_rnd_vx_byte(CHIP8 *ch8, u8 x, u8 kk)
+{
+	u8 byte = chip8_random_byte(ch8);
+	ch8->V[x] = byte & kk;
+}
+
+
+/* Dxyn on the hi-res display, see below. */
+static void dxyn_hires(CHIP8 *ch8, u8 x, u8 y, u8 n)
+{
+	u8 col = ch8->V[x] % DISPLAY_HIRES_LENGTH;
+	u8 row = ch8->V[y] % DISPLAY_HIRES_HEIGHT;
+	u8 height = n ? n : 16;
+	u8 width = n ? 8 : 16;
+	u64 collision = 0;
+	u8 i;
+
+	if (chip8_trap(ch8, ch8->I + height * (width / 8) > MEMORY_SIZE, CHIP8_FAULT_MEMORY)) {
+		return;
+	}
+	for (i = 0; i < height; i++) {
+		u8 r = (row + i) % DISPLAY_HIRES_HEIGHT;
+		u64 *old = ch8->hires_display[r];
+		u16 addr = ch8->I + i * (width / 8);
+		u64 bits = n ? ch8->memory[CHIP8_ADDR(addr)] :
+			   (ch8->memory[CHIP8_ADDR(addr)] << 8) | ch8->memory[CHIP8_ADDR(addr + 1)];
+		u64 hi = bits << (64 - width);
+		u64 lo = 0;
+
+		rotr128(&hi, &lo, col);
+		collision |= (old[0] & hi) | (old[1] & lo);
+		old[0] ^= hi;
+		old[1] ^= lo;
+		if (hi | lo) {
+			ch8->hires_dirty_rows |= (u64)1 << r;
+		}
+	}
+	ch8->V[0xF] = collision != 0;
+}
+
+
+/*
+ * Dxyn - DRW Vx, Vy, nibble
+ * Display n-byte sprite starting at memory location I at (Vx, Vy), set VF = collision.
+ *
+ * The interpreter reads n bytes from memory, starting at the address stored in I. These bytes are then displayed as sprites on screen at coordinates (Vx, Vy).
+ * Sprites are XORed onto the existing screen. If this causes any pixels to be erased, VF is set to 1, otherwise it is set to 0.
+ * If the sprite is positioned so part of it is outside the coordinates of the display, it wraps around to the opposite side of the screen.
+ *
+ * Each sprite byte is placed at the left end of a 64-bit row mask and rotated right by Vx, which also takes care of the horizontal wrap.
+ * The whole row is then XORed at once and collisions are collected from (old & mask), without looking at single pixels.
+ * In hi-res mode the sprite is drawn on the 128x64 display the same way with a 128-bit mask, and Dxy0 draws a 16x16 sprite from 32 bytes at I.
+ */
+void instr_dxyn_drw_vx_vy_nibble(CHIP8 *ch8, u8 x, u8 y, u8 n)
+{
+	u8 col = ch8->V[x] % DISPLAY_LENGTH;
+	u8 row = ch8->V[y] % DISPLAY_HEIGHT;
+	u64 collision = 0;
+	u8 i;
+
+	if (ch8->hires) {
+		dxyn_hires(ch8, x, y, n);
+		return;
+	}
+	if (chip8_trap(ch8, ch8->I + n > MEMORY_SIZE, CHIP8_FAULT_MEMORY)) {
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		u8 r = (row + i) % DISPLAY_HEIGHT;
+		u64 mask = rotr64((u64)ch8->memory[CHIP8_ADDR(ch8->I + i)] << (DISPLAY_LENGTH - 8), col);
+		u64 old = display_load_row(ch8, r);
+
+		collision |= old & mask;
+		display_store_row(ch8, r, old ^ mask);
+		if (mask) {
+			ch8->dirty_rows |= (u32)1 << r;
+		}
+	}
+	ch8->V[0xF] = collision != 0;
+}
+
+
+/*
+ * Ex9E - SKP Vx
+ * Skip next instruction if key with the value of Vx is pressed.
+ *
+ * Checks the keyboard, and if the key corresponding to the value of Vx is currently in the down position, PC is increased by 2.
+ */
+void instr_ex9e_skp_vx(CHIP8 *ch8, u8 x)
+{
+	if (key_is_down(ch8, ch8->V[x] & 0x0F)) {
+		ch8->pc += 2;
+	}
+}
+
+
+/*
+ * ExA1 - SKNP Vx
+ * Skip next instruction if key with the value of Vx is not pressed.
+ *
+ * Checks the keyboard, and if the key corresponding to the value of Vx is currently in the up position, PC is increased by 2.
+ */
+void instr_exa1_sknp_vx(CHIP8 *ch8, u8 x)
+{
+	if (!key_is_down(ch8, ch8->V[x] & 0x0F)) {
+		ch8->pc += 2;
+	}
+}
+
+
+/*
+ * Fx0A - LD Vx, K
+ * Wait for a key press, store the value of the key in Vx.
+ *
+ * All execution stops until a key is pressed, then the value of that key is stored in Vx.
+ * The wait is done by executing this instruction again until a key is down; with several keys down, the lowest one is taken.
+ */
+void instr_fx0a_ld_vx_k(CHIP8 *ch8, u8 x)
+{
+	u16 keys = keypad_mask(ch8);
+
+	if (!keys) {
+		ch8->pc -= 2;
+		return;
+	}
+	ch8->V[x] = ctz32(keys);
+}
+
+
+/*
+ * Fx07 - LD Vx, DT
+ * Set Vx = delay timer value.
+ *
+ * The value of DT is placed into Vx.
+ */
+void instr_fx07_ld_vx_dt(CHIP8 *ch8, u8 x)
+{
+	ch8->V[x] = ch8->delay_timer;
+}
+
+
+/*
+ * Fx15 - LD DT, Vx
+ * Set delay timer = Vx.
+ *
+ * DT is set equal to the value of Vx.
+ */
+void instr_fx15_ld_dt_vx(CHIP8 *ch8, u8 x)
+{
+	ch8->delay_timer = ch8->V[x];
+}
+
+
+/*
+ * Fx18 - LD ST, Vx
+ * Set sound timer = Vx.
+ *
+ * ST is set equal to the value of Vx.
+ */
+void instr_fx18_ld_st_vx(CHIP8 *ch8, u8 x)
+{
+	ch8->sound_timer = ch8->V[x];
+}
+
+
+/*
+ * Fx29 - LD F, Vx
+ * Set I = location of sprite for digit Vx.
+ *
+ * The value of I is set to the location for the hexadecimal sprite corresponding to the value of Vx.
+ * The font is loaded at FONT_ADDRESS by chip8_load_rom and chip8_image_init, five bytes per digit.
+ */
+void instr_fx29_ld_f_vx(CHIP8 *ch8, u8 x)
+{
+	ch8->I = FONT_ADDRESS + (ch8->V[x] & 0x0F) * FONT_SPRITE_SIZE;
+}
+
+
+/*
+ * Fx1E - ADD I, Vx
+ * Set I = I + Vx.
+ *
+ * The values of I and Vx are added, and the results are stored in I.
+ */
+void instr_fx1e_add_i_vx(CHIP8 *ch8, u8 x)
+{
+	ch8->I += ch8->V[x];
+}
+
+
+/*
+ * Fx33 - LD B, Vx
+ * Store BCD representation of Vx in memory locations I, I+1, and I+2.
+ *
+ * The interpreter takes the decimal value of Vx, and places the hundreds digit in memory at location in I,
+ * the tens digit at location I+1, and the ones digit at location I+2.
+ */
+void instr_fx33_ld_b_vx(CHIP8 *ch8, u8 x)
+{
+	u8 v = ch8->V[x];
+
+	if (chip8_trap(ch8, ch8->I + 3 > MEMORY_SIZE, CHIP8_FAULT_MEMORY)) {
+		return;
+	}
+	chip8_write_memory(ch8, CHIP8_ADDR(ch8->I), v / 100);
+	chip8_write_memory(ch8, CHIP8_ADDR(ch8->I + 1), v / 10 % 10);
+	chip8_write_memory(ch8, CHIP8_ADDR(ch8->I + 2), v % 10);
+}
+
+
+/*
+ * Fx55 - LD [I], Vx
+ * Store registers V0 through Vx in memory starting at location I.
+ *
+ * The interpreter copies the values of registers V0 through Vx into memory, starting at the address in I.
+ * I itself is left alone; the quirk profiles that advance it are applied in quirk_fx55.
+ */
+void instr_fx55_ld_i_vx(CHIP8 *ch8, u8 x)
+{
+	u8 i;
+
+	if (chip8_trap(ch8, ch8->I + x + 1 > MEMORY_SIZE, CHIP8_FAULT_MEMORY)) {
+		return;
+	}
+	for (i = 0; i <= x; i++) {
+		chip8_write_memory(ch8, CHIP8_ADDR(ch8->I + i), ch8->V[i]);
+	}
+}
+
+
+/*
+ * Fx65 - LD Vx, [I]
+ * Read registers V0 through Vx from memory starting at location I.
+ *
+ * The interpreter reads values from memory starting at location I into registers V0 through Vx.
+ * As with Fx55, I is left alone here.
+ */
+void instr_fx65_ld_vx_i(CHIP8 *ch8, u8 x)
+{
+	u8 i;
+
+	if (chip8_trap(ch8, ch8->I + x + 1 > MEMORY_SIZE, CHIP8_FAULT_MEMORY)) {
+		return;
+	}
+	for (i = 0; i <= x; i++) {
+		ch8->V[i] = ch8->memory[CHIP8_ADDR(ch8->I + i)];
+	}
+}
+
+
+/*
+ * 00Cn - SCD nibble
+ * Scroll the display down by n lines.
+ *
+ * Rows are moved down whole with one memmove and the n rows at the top are cleared. Lines are those of the mode in use.
+ */
+void instr_00cn_scd_nibble(CHIP8 *ch8, u8 n)
+{
+	u8 *rows = (u8 *)ch8->display;
+	size_t row_size = sizeof(ch8->display) / DISPLAY_HEIGHT;
+
+	if (!n) {
+		return;
+	}
+	if (ch8->hires) {
+		memmove(ch8->hires_display[n], ch8->hires_display[0],
+			(DISPLAY_HIRES_HEIGHT - n) * sizeof(ch8->hires_display[0]));
+		memset(ch8->hires_display, 0, n * sizeof(ch8->hires_display[0]));
+		ch8->hires_dirty_rows = ~(u64)0;
+		return;
+	}
+	memmove(rows + n * row_size, rows, (DISPLAY_HEIGHT - n) * row_size);
+	memset(rows, 0, n * row_size);
+	ch8->dirty_rows = ~(u32)0;
+}
+
+
+/*
+ * 00FB - SCR
+ * Scroll the display right by 4 pixels.
+ *
+ * Every row is shifted as a whole, across both words of a hi-res row; the 4 pixels shifted in on the left are cleared.
+ */
+void instr_00fb_scr(CHIP8 *ch8)
+{
+	u8 row;
+
+	if (ch8->hires) {
+		for (row = 0; row < DISPLAY_HIRES_HEIGHT; row++) {
+			u64 *bits = ch8->hires_display[row];
+
+			if (bits[0] | bits[1]) {
+				bits[1] = (bits[1] >> 4) | (bits[0] << 60);
+				bits[0] >>= 4;
+				ch8->hires_dirty_rows |= (u64)1 << row;
+			}
+		}
+		return;
+	}
+	for (row = 0; row < DISPLAY_HEIGHT; row++) {
+		u64 bits = display_load_row(ch8, row);
+
+		if (bits) {
+			display_store_row(ch8, row, bits >> 4);
+			ch8->dirty_rows |= (u32)1 << row;
+		}
+	}
+}
+
+
+/*
+ * 00FC - SCL
+ * Scroll the display left by 4 pixels.
+ *
+ * The mirror image of 00FB.
+ */
+void instr_00fc_scl(CHIP8 *ch8)
+{
+	u8 row;
+
+	if (ch8->hires) {
+		for (row = 0; row < DISPLAY_HIRES_HEIGHT; row++) {
+			u64 *bits = ch8->hires_display[row];
+
+			if (bits[0] | bits[1]) {
+				bits[0] = (bits[0] << 4) | (bits[1] >> 60);
+				bits[1] <<= 4;
+				ch8->hires_dirty_rows |= (u64)1 << row;
+			}
+		}
+		return;
+	}
+	for (row = 0; row < DISPLAY_HEIGHT; row++) {
+		u64 bits = display_load_row(ch8, row);
+
+		if (bits) {
+			display_store_row(ch8, row, bits << 4);
+			ch8->dirty_rows |= (u32)1 << row;
+		}
+	}
+}
+
+
+/* Switch display modes, clearing the display being switched to. */
+static void display_set_hires(CHIP8 *ch8, u8 hires)
+{
+	if (ch8->hires == hires) {
+		return;
+	}
+	ch8->hires = hires;
+	if (hires) {
+		memset(ch8->hires_display, 0, sizeof(ch8->hires_display));
+	} else {
+		memset(ch8->display, 0, sizeof(ch8->display));
+	}
+	ch8->dirty_rows = ~(u32)0;
+	ch8->hires_dirty_rows = ~(u64)0;
+}
+
+
+/*
+ * 00FE - LOW
+ * Disable extended screen mode for full-screen graphics.
+ *
+ * Back to the 64x32 display, cleared. Nothing happens if it is already in use.
+ */
+void instr_00fe_low(CHIP8 *ch8)
+{
+	display_set_hires(ch8, 0);
+}
+
+
+/*
+ * 00FF - HIGH
+ * Enable extended screen mode for full-screen graphics.
+ *
+ * Switches to the 128x64 display, cleared. Nothing happens if it is already in use.
+ */
+void instr_00ff_high(CHIP8 *ch8)
+{
+	display_set_hires(ch8, 1);
+}
+
+
+/*
+ * Decode and dispatch.
+ *
+ * Every opcode is routed through a jump table indexed by its first nibble. The 0, 8, E and F groups
+ * share a first nibble between several instructions and go through a second-level table.
+ * Opcodes that are not (yet) implemented end up in op_unknown and are ignored, like 0nnn.
+ *
+ * The op_* wrappers take the unpacked operands of struct chip8_insn and call the matching instr_*
+ * handler, so the handlers above stay the single source of truth for each instruction's semantics.
+ */
+static void op_unknown(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	(void)ch8;
+	(void)insn;
+}
+
+static void op_0nnn(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	instr_0nnn(ch8, insn->nnn);
+}
+
+static void op_00e0(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	(void)insn;
+	instr_00e0_cls(ch8);
+}
+
+static void op_00ee(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	(void)insn;
+	instr_00ee_ret(ch8);
+}
+
+static void op_00cn(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	instr_00cn_scd_nibble(ch8, insn->n);
+}
+
+static void op_00fb(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	(void)insn;
+	instr_00fb_scr(ch8);
+}
+
+static void op_00fc(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	(void)insn;
+	instr_00fc_scl(ch8);
+}
+
+static void op_00fe(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	(void)insn;
+	instr_00fe_low(ch8);
+}
+
+static void op_00ff(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	(void)insn;
+	instr_00ff_high(ch8);
+}
+
+static void op_1nnn(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	instr_1nnn_jp_addr(ch8, insn->nnn);
+}
+
+static void op_2nnn(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	instr_2nnn_call_addr(ch8, insn->nnn);
+}
+
+static void op_3xkk(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	instr_3xkk_se_vx_byte(ch8, insn->x, insn->kk);
+}
+
+static void op_4xkk(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	instr_4xkk_sne_vx_byte(ch8, insn->x, insn->kk);
+}
+
+static void op_5xy0(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	instr_5xy0_se_vx_vy(ch8, insn->x, insn->y);
+}
+
+static void op_6xkk(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	instr_6xkk_ld_vx_byte(ch8, insn->x, insn->kk);
+}
+
+static void op_7xkk(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	instr_7xkk_add_vx_byte(ch8, insn->x, insn->kk);
+}
+
+static void op_8xy0(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	instr_8xy0_ld_vx_vy(ch8, insn->x, insn->y);
+}
+
+static void op_8xy1(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	instr_8xy1_or_vx_vy(ch8, insn->x, insn->y);
+}
+
+static void op_8xy2(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	instr_8xy2_and_vx_vy(ch8, insn->x, insn->y);
+}
+
+static void op_8xy3(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	instr_8xy3_xor_vx_vy(ch8, insn->x, insn->y);
+}
+
+static void op_8xy4(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	instr_8xy4_add_vx_vy(ch8, insn->x, insn->y);
+}
+
+static void op_8xy5(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	instr_8xy5_sub_vx_vy(ch8, insn->x, insn->y);
+}
+
+static void op_8xy6(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	instr_8xy6_shr_vx(ch8, insn->x);
+}
+
+static void op_8xy7(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	instr_8xy7_subn_vx_vy(ch8, insn->x, insn->y);
+}
+
+static void op_8xye(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	instr_8xye_shl_vx(ch8, insn->x);
+}
+
+static void op_9xy0(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	instr_9xy0_sne_vx_vy(ch8, insn->x, insn->y);
+}
+
+static void op_annn(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	instr_annn_ld_i_addr(ch8, insn->nnn);
+}
+
+static void op_bnnn(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	instr_bnnn_jp_v0_addr(ch8, insn->nnn);
+}
+
+static void op_cxkk(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	cxkk_rnd_vx_byte(ch8, insn->x, insn->kk);
+}
+
+static void op_dxyn(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	instr_dxyn_drw_vx_vy_nibble(ch8, insn->x, insn->y, insn->n);
+}
+
+static void op_ex9e(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	instr_ex9e_skp_vx(ch8, insn->x);
+}
+
+static void op_exa1(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	instr_exa1_sknp_vx(ch8, insn->x);
+}
+
+static void op_fx07(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	instr_fx07_ld_vx_dt(ch8, insn->x);
+}
+
+static void op_fx0a(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	instr_fx0a_ld_vx_k(ch8, insn->x);
+}
+
+static void op_fx15(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	instr_fx15_ld_dt_vx(ch8, insn->x);
+}
+
+static void op_fx18(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	instr_fx18_ld_st_vx(ch8, insn->x);
+}
+
+static void op_fx29(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	instr_fx29_ld_f_vx(ch8, insn->x);
+}
+
+static void op_fx1e(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	instr_fx1e_add_i_vx(ch8, insn->x);
+}
+
+static void op_fx33(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	instr_fx33_ld_b_vx(ch8, insn->x);
+}
+
+static void op_fx55(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	instr_fx55_ld_i_vx(ch8, insn->x);
+}
+
+static void op_fx65(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	instr_fx65_ld_vx_i(ch8, insn->x);
+}
+
+/*
+ * Indexed by the low byte of 00KK. Empty slots, and every opcode with a non-zero second nibble,
+ * are SYS addr. The SUPER-CHIP instructions only exist in the CHIP8_QUIRKS_SCHIP table; every
+ * other profile runs them as SYS addr, as the interpreters it models do.
+ */
+static const chip8_op op_table_0[256] = {
+	[0xE0] = op_00e0,
+	[0xEE] = op_00ee,
+};
+
+static const chip8_op op_table_0_schip[256] = {
+	[0xC0] = op_00cn, [0xC1] = op_00cn, [0xC2] = op_00cn, [0xC3] = op_00cn,
+	[0xC4] = op_00cn, [0xC5] = op_00cn, [0xC6] = op_00cn, [0xC7] = op_00cn,
+	[0xC8] = op_00cn, [0xC9] = op_00cn, [0xCA] = op_00cn, [0xCB] = op_00cn,
+	[0xCC] = op_00cn, [0xCD] = op_00cn, [0xCE] = op_00cn, [0xCF] = op_00cn,
+	[0xE0] = op_00e0,
+	[0xEE] = op_00ee,
+	[0xFB] = op_00fb,
+	[0xFC] = op_00fc,
+	[0xFE] = op_00fe,
+	[0xFF] = op_00ff,
+};
+
+/* Indexed by the last nibble of 8xyN. */
+#define OP_TABLE_8(xy1, xy2, xy3, xy6, xye) { \
+	op_8xy0, xy1, xy2, xy3, op_8xy4, op_8xy5, xy6, op_8xy7, \
+	op_unknown, op_unknown, op_unknown, op_unknown, op_unknown, op_unknown, xye, op_unknown, \
+}
+
+/* Indexed by the low byte of ExKK and FxKK. Empty slots decode to op_unknown. */
+static const chip8_op op_table_e[256] = {
+	[0x9E] = op_ex9e,
+	[0xA1] = op_exa1,
+};
+
+#define OP_TABLE_F(fx55, fx65) { \
+	[0x07] = op_fx07, \
+	[0x0A] = op_fx0a, \
+	[0x15] = op_fx15, \
+	[0x18] = op_fx18, \
+	[0x1E] = op_fx1e, \
+	[0x29] = op_fx29, \
+	[0x33] = op_fx33, \
+	[0x55] = fx55, \
+	[0x65] = fx65, \
+}
+
+/* Indexed by the first nibble of the opcode. Group slots are resolved by the second-level tables. */
+#define OP_TABLE(bnnn) { \
+	NULL, op_1nnn, op_2nnn, op_3xkk, op_4xkk, op_5xy0, op_6xkk, op_7xkk, \
+	NULL, op_9xy0, op_annn, bnnn, op_cxkk, op_dxyn, NULL, NULL, \
+}
+
+static const chip8_op op_table_8[16] = OP_TABLE_8(op_8xy1, op_8xy2, op_8xy3, op_8xy6, op_8xye);
+static const chip8_op op_table_f[256] = OP_TABLE_F(op_fx55, op_fx65);
+static const chip8_op op_table[16] = OP_TABLE(op_bnnn);
+
+/*
+ * Quirk profiles.
+ *
+ * The handlers above follow Cowgod's reference, which is CHIP8_QUIRKS_DEFAULT. Programs written
+ * for other interpreters expect a few instructions to behave the way those did:
+ *
+ *			8xy1/2/3	8xy6/8xyE	Bnnn		Fx55/Fx65
+ *	DEFAULT		VF kept		Vx shifted	V0 + nnn	I kept
+ *	VIP		VF = 0		Vy shifted	V0 + nnn	I += x + 1
+ *	CHIP48		VF kept		Vx shifted	Vx + nnn	I += x
+ *	SCHIP		VF kept		Vx shifted	Vx + nnn	I kept
+ *
+ * SCHIP also adds the scroll and display-mode instructions 00Cn, 00FB, 00FC, 00FE and 00FF,
+ * which the other profiles run as SYS addr.
+ *
+ * A machine's profile is set with chip8_set_quirks and resolved when an instruction is decoded,
+ * never while it runs. The quirk_* templates take the profile as an argument and are only ever
+ * called with a constant, so each one folds down to the single behaviour it is instantiated for.
+ * CHIP8_QUIRK_OPS instantiates them as op_* wrappers and op tables per profile, chip8_decode
+ * picks the tables, and the interpreter loop is likewise built once per profile.
+ */
+enum chip8_quirks {
+	CHIP8_QUIRKS_DEFAULT,
+	CHIP8_QUIRKS_VIP,
+	CHIP8_QUIRKS_CHIP48,
+	CHIP8_QUIRKS_SCHIP,
+	CHIP8_QUIRK_PROFILES
+};
+
+#define QUIRK_VF_RESET(quirks) ((quirks) == CHIP8_QUIRKS_VIP)
+#define QUIRK_SHIFT_VY(quirks) ((quirks) == CHIP8_QUIRKS_VIP)
+#define QUIRK_JUMP_VX(quirks) ((quirks) == CHIP8_QUIRKS_CHIP48 || (quirks) == CHIP8_QUIRKS_SCHIP)
+#define QUIRK_INDEX_STEP(quirks, x) \
+	((quirks) == CHIP8_QUIRKS_VIP ? (x) + 1 : (quirks) == CHIP8_QUIRKS_CHIP48 ? (x) : 0)
+
+static inline void quirk_8xy1(CHIP8 *ch8, u8 x, u8 y, u8 quirks)
+{
+	instr_8xy1_or_vx_vy(ch8, x, y);
+	if (QUIRK_VF_RESET(quirks)) {
+		ch8->V[0xF] = 0;
+	}
+}
+
+static inline void quirk_8xy2(CHIP8 *ch8, u8 x, u8 y, u8 quirks)
+{
+	instr_8xy2_and_vx_vy(ch8, x, y);
+	if (QUIRK_VF_RESET(quirks)) {
+		ch8->V[0xF] = 0;
+	}
+}
+
+static inline void quirk_8xy3(CHIP8 *ch8, u8 x, u8 y, u8 quirks)
+{
+	instr_8xy3_xor_vx_vy(ch8, x, y);
+	if (QUIRK_VF_RESET(quirks)) {
+		ch8->V[0xF] = 0;
+	}
+}
+
+static inline void quirk_8xy6(CHIP8 *ch8, u8 x, u8 y, u8 quirks)
+{
+	if (QUIRK_SHIFT_VY(quirks)) {
+		ch8->V[x] = ch8->V[y];
+	}
+	instr_8xy6_shr_vx(ch8, x);
+}
+
+static inline void quirk_8xye(CHIP8 *ch8, u8 x, u8 y, u8 quirks)
+{
+	if (QUIRK_SHIFT_VY(quirks)) {
+		ch8->V[x] = ch8->V[y];
+	}
+	instr_8xye_shl_vx(ch8, x);
+}
+
+static inline void quirk_bnnn(CHIP8 *ch8, u16 nnn, u8 quirks)
+{
+	if (QUIRK_JUMP_VX(quirks)) {
+		ch8->pc = CHIP8_ADDR(nnn + ch8->V[nnn >> 8]);
+	} else {
+		instr_bnnn_jp_v0_addr(ch8, nnn);
+	}
+}
+
+/* A trapped Fx55 or Fx65 does nothing, so I only moves on when the access went through. */
+static inline void quirk_fx55(CHIP8 *ch8, u8 x, u8 quirks)
+{
+	instr_fx55_ld_i_vx(ch8, x);
+	if (!chip8_faulted(ch8)) {
+		ch8->I += QUIRK_INDEX_STEP(quirks, x);
+	}
+}
+
+static inline void quirk_fx65(CHIP8 *ch8, u8 x, u8 quirks)
+{
+	instr_fx65_ld_vx_i(ch8, x);
+	if (!chip8_faulted(ch8)) {
+		ch8->I += QUIRK_INDEX_STEP(quirks, x);
+	}
+}
+
+#define CHIP8_QUIRK_OPS(p, quirks) \
+static void op_8xy1_##p(CHIP8 *ch8, const struct chip8_insn *insn) \
+{ \
+	quirk_8xy1(ch8, insn->x, insn->y, quirks); \
+} \
+ \
+static void op_8xy2_##p(CHIP8 *ch8, const struct chip8_insn *insn) \
+{ \
+	quirk_8xy2(ch8, insn->x, insn->y, quirks); \
+} \
+ \
+static void op_8xy3_##p(CHIP8 *ch8, const struct chip8_insn *insn) \
+{ \
+	quirk_8xy3(ch8, insn->x, insn->y, quirks); \
+} \
+ \
+static void op_8xy6_##p(CHIP8 *ch8, const struct chip8_insn *insn) \
+{ \
+	quirk_8xy6(ch8, insn->x, insn->y, quirks); \
+} \
+ \
+static void op_8xye_##p(CHIP8 *ch8, const struct chip8_insn *insn) \
+{ \
+	quirk_8xye(ch8, insn->x, insn->y, quirks); \
+} \
+ \
+static void op_bnnn_##p(CHIP8 *ch8, const struct chip8_insn *insn) \
+{ \
+	quirk_bnnn(ch8, insn->nnn, quirks); \
+} \
+ \
+static void op_fx55_##p(CHIP8 *ch8, const struct chip8_insn *insn) \
+{ \
+	quirk_fx55(ch8, insn->x, quirks); \
+} \
+ \
+static void op_fx65_##p(CHIP8 *ch8, const struct chip8_insn *insn) \
+{ \
+	quirk_fx65(ch8, insn->x, quirks); \
+} \
+ \
+static const chip8_op op_table_8_##p[16] = \
+	OP_TABLE_8(op_8xy1_##p, op_8xy2_##p, op_8xy3_##p, op_8xy6_##p, op_8xye_##p); \
+static const chip8_op op_table_f_##p[256] = OP_TABLE_F(op_fx55_##p, op_fx65_##p); \
+static const chip8_op op_table_##p[16] = OP_TABLE(op_bnnn_##p);
+
+CHIP8_QUIRK_OPS(vip, CHIP8_QUIRKS_VIP)
+CHIP8_QUIRK_OPS(chip48, CHIP8_QUIRKS_CHIP48)
+CHIP8_QUIRK_OPS(schip, CHIP8_QUIRKS_SCHIP)
+
+/* The first-level, 0 group, 8 group and F group tables of each profile; the E group is shared. */
+static const struct {
+	const chip8_op *top;
+	const chip8_op *group_0;
+	const chip8_op *group_8;
+	const chip8_op *group_f;
+} op_tables[CHIP8_QUIRK_PROFILES] = {
+	[CHIP8_QUIRKS_DEFAULT] = { op_table, op_table_0, op_table_8, op_table_f },
+	[CHIP8_QUIRKS_VIP] = { op_table_vip, op_table_0, op_table_8_vip, op_table_f_vip },
+	[CHIP8_QUIRKS_CHIP48] = {
+		op_table_chip48, op_table_0, op_table_8_chip48, op_table_f_chip48,
+	},
+	[CHIP8_QUIRKS_SCHIP] = {
+		op_table_schip, op_table_0_schip, op_table_8_schip, op_table_f_schip,
+	},
+};
+
+/* Whether opcode runs differently under quirks than under the default profile. */
+static inline int chip8_quirk_affects(u8 quirks, u16 opcode)
+{
+	if (quirks == CHIP8_QUIRKS_DEFAULT) {
+		return 0;
+	}
+	switch (opcode >> 12) {
+	case 0x0:
+		return quirks == CHIP8_QUIRKS_SCHIP && !(opcode & 0x0F00) &&
+		       op_table_0_schip[OPCODE_KK(opcode)] != op_table_0[OPCODE_KK(opcode)];
+	case 0x8:
+		return (0x404E >> OPCODE_N(opcode)) & 1;
+	case 0xB:
+		return 1;
+	case 0xF:
+		return OPCODE_KK(opcode) == 0x55 || OPCODE_KK(opcode) == 0x65;
+	}
+	return 0;
+}
+
+static void drop_code(CHIP8 *ch8);
+
+/*
+ * Switch ch8 to a quirk profile. Anything already decoded or compiled is dropped, and a
+ * translated program built for another profile is detached.
+ */
+void chip8_set_quirks(CHIP8 *ch8, enum chip8_quirks quirks)
+{
+	ch8->quirks = quirks;
+	drop_code(ch8);
+}
+
+/* The handler for opcode under quirks. */
+static inline chip8_op quirk_lookup(u16 opcode, u8 quirks)
+{
+	chip8_op op;
+
+	switch (opcode >> 12) {
+	case 0x0:
+		op = opcode & 0x0F00 ? NULL : op_tables[quirks].group_0[OPCODE_KK(opcode)];
+		if (!op) {
+			op = op_0nnn;
+		}
+		break;
+	case 0x8:
+		op = op_tables[quirks].group_8[OPCODE_N(opcode)];
+		break;
+	case 0xE:
+		op = op_table_e[OPCODE_KK(opcode)];
+		break;
+	case 0xF:
+		op = op_tables[quirks].group_f[OPCODE_KK(opcode)];
+		break;
+	default:
+		op = op_tables[quirks].top[opcode >> 12];
+		break;
+	}
+	return op ? op : op_unknown;
+}
+
+/* The handler for opcode under the default profile, which is all static analysis needs. */
+static chip8_op chip8_lookup(u16 opcode)
+{
+	return quirk_lookup(opcode, CHIP8_QUIRKS_DEFAULT);
+}
+
+static inline void chip8_decode(u16 opcode, struct chip8_insn *insn, u8 quirks)
+{
+	insn->handler = quirk_lookup(opcode, quirks);
+	insn->len = 1;
+	insn->nnn = OPCODE_NNN(opcode);
+	insn->x = OPCODE_X(opcode);
+	insn->y = OPCODE_Y(opcode);
+	insn->kk = OPCODE_KK(opcode);
+	insn->n = OPCODE_N(opcode);
+}
+
+/*
+ * Attach a caller-allocated decode cache to ch8, or detach it with NULL. The cache starts out
+ * empty and is filled as instructions are executed.
+ */
+void chip8_icache_attach(CHIP8 *ch8, struct chip8_icache *icache)
+{
+	ch8->icache = icache;
+	if (icache) {
+		memset(icache, 0, sizeof(*icache));
+	}
+}
+
+/*
+ * Run ch8 through the translated program aot from now on, or stop with NULL. Returns -1 and
+ * leaves ch8 alone if its memory does not hold the image aot was translated from, or it runs
+ * under another quirk profile.
+ */
+int chip8_aot_attach(CHIP8 *ch8, const struct chip8_aot *aot)
+{
+	if (aot && (aot->quirks != ch8->quirks ||
+		    memcmp(ch8->memory + PROGRAM_START_ADDRESS, aot->rom, aot->len) != 0)) {
+		return -1;
+	}
+	ch8->aot = aot;
+	return 0;
+}
+
+/* Execute one opcode as if fetched from pc, for translated code without an inline form of it. */
+void chip8_aot_exec(CHIP8 *ch8, u16 opcode)
+{
+	struct chip8_insn insn;
+
+	chip8_decode(opcode, &insn, ch8->quirks);
+	insn.handler(ch8, &insn);
+}
+
+/*
+ * Drop the cached decode and any compiled block covering [addr, addr + len) and mark the range
+ * as written. Call this after writing to memory[] directly instead of through
+ * chip8_write_memory, e.g. when loading a ROM.
+ */
+void chip8_invalidate_code(CHIP8 *ch8, u16 addr, u16 len)
+{
+	u32 end = (u32)addr + len;
+	u32 i;
+
+	if (end > MEMORY_SIZE) {
+		end = MEMORY_SIZE;
+	}
+	for (i = addr; i < end; i++) {
+		ch8->written_pages |= 1u << (i / MEMORY_PAGE_SIZE);
+		if (ch8->icache) {
+			icache_invalidate(ch8->icache, i);
+		}
+		aot_invalidate(ch8, i);
+#ifdef CHIP8_JIT
+		if (ch8->jit) {
+			chip8_jit_invalidate(ch8, i);
+		}
+#endif
+	}
+}
+
+/*
+ * Disassembly in Cowgod's mnemonics, with Vx, Vy and n as hex digits and kk and nnn as 0x-prefixed
+ * hex. Opcodes that do not decode to an instruction come out as DW and the opcode.
+ */
+#define CHIP8_DISASM_MAX 24
+
+static const char *const disasm_8[16] = {
+	"LD V%x, V%y", "OR V%x, V%y", "AND V%x, V%y", "XOR V%x, V%y",
+	"ADD V%x, V%y", "SUB V%x, V%y", "SHR V%x {, V%y}", "SUBN V%x, V%y",
+	NULL, NULL, NULL, NULL, NULL, NULL, "SHL V%x {, V%y}", NULL,
+};
+
+static const char *disasm_template(u16 opcode)
+{
+	switch (opcode >> 12) {
+	case 0x0:
+		switch (opcode) {
+		case 0x00E0:
+			return "CLS";
+		case 0x00EE:
+			return "RET";
+		case 0x00FB:
+			return "SCR";
+		case 0x00FC:
+			return "SCL";
+		case 0x00FE:
+			return "LOW";
+		case 0x00FF:
+			return "HIGH";
+		}
+		return (opcode & 0xFFF0) == 0x00C0 ? "SCD %n" : "SYS %a";
+	case 0x1:
+		return "JP %a";
+	case 0x2:
+		return "CALL %a";
+	case 0x3:
+		return "SE V%x, %k";
+	case 0x4:
+		return "SNE V%x, %k";
+	case 0x5:
+		return OPCODE_N(opcode) == 0 ? "SE V%x, V%y" : NULL;
+	case 0x6:
+		return "LD V%x, %k";
+	case 0x7:
+		return "ADD V%x, %k";
+	case 0x8:
+		return disasm_8[OPCODE_N(opcode)];
+	case 0x9:
+		return OPCODE_N(opcode) == 0 ? "SNE V%x, V%y" : NULL;
+	case 0xA:
+		return "LD I, %a";
+	case 0xB:
+		return "JP V0, %a";
+	case 0xC:
+		return "RND V%x, %k";
+	case 0xD:
+		return "DRW V%x, V%y, %n";
+	case 0xE:
+		switch (OPCODE_KK(opcode)) {
+		case 0x9E:
+			return "SKP V%x";
+		case 0xA1:
+			return "SKNP V%x";
+		}
+		return NULL;
+	default:
+		switch (OPCODE_KK(opcode)) {
+		case 0x07:
+			return "LD V%x, DT";
+		case 0x0A:
+			return "LD V%x, K";
+		case 0x15:
+			return "LD DT, V%x";
+		case 0x18:
+			return "LD ST, V%x";
+		case 0x1E:
+			return "ADD I, V%x";
+		case 0x29:
+			return "LD F, V%x";
+		case 0x33:
+			return "LD B, V%x";
+		case 0x55:
+			return "LD [I], V%x";
+		case 0x65:
+			return "LD V%x, [I]";
+		}
+		return NULL;
+	}
+}
+
+static char *put_hex(char *out, u16 v, int digits)
+{
+	while (digits--) {
+		*out++ = "0123456789ABCDEF"[(v >> (4 * digits)) & 0xF];
+	}
+	return out;
+}
+
+/*
+ * Write the disassembly of opcode to out, which must hold CHIP8_DISASM_MAX bytes, as a
+ * NUL-terminated string.
+ */
+void chip8_disassemble(u16 opcode, char *out)
+{
+	const char *t = disasm_template(opcode);
+
+	if (!t) {
+		t = "DW %w";
+	}
+	for (; *t; t++) {
+		if (*t != '%') {
+			*out++ = *t;
+			continue;
+		}
+		switch (*++t) {
+		case 'x':
+			out = put_hex(out, OPCODE_X(opcode), 1);
+			break;
+		case 'y':
+			out = put_hex(out, OPCODE_Y(opcode), 1);
+			break;
+		case 'n':
+			out = put_hex(out, OPCODE_N(opcode), 1);
+			break;
+		case 'k':
+			*out++ = '0';
+			*out++ = 'x';
+			out = put_hex(out, OPCODE_KK(opcode), 2);
+			break;
+		case 'a':
+			*out++ = '0';
+			*out++ = 'x';
+			out = put_hex(out, OPCODE_NNN(opcode), 3);
+			break;
+		case 'w':
+			*out++ = '0';
+			*out++ = 'x';
+			out = put_hex(out, opcode, 4);
+			break;
+		}
+	}
+	*out = '\0';
+}
+
+/*
+ * Static control-flow analysis.
+ *
+ * chip8_analyze walks a program from its entry point without running it, following 1nnn and
+ * 2nnn to their targets, both outcomes of every skip (3xkk, 4xkk, 5xy0, 9xy0, Ex9E, ExA1) and
+ * the return address after each call. What it finds goes into a chip8_cfg:
+ *
+ *   map      one byte of CHIP8_MAP_* flags per address: code, the first byte of an instruction,
+ *            a block start, a subroutine entry, a computed jump, or data that Annn points at
+ *   blocks   basic blocks in address order, each with up to two successors
+ *   calls    the call graph, one edge per distinct caller and callee, with the program entry
+ *            counted as a subroutine
+ *
+ * Bnnn jumps to V0 + nnn, which is not known ahead of time; the walk stops there and marks the
+ * instruction CHIP8_MAP_COMPUTED so callers know the map may be missing code. Whatever the walk
+ * doesn't reach is data as far as the analysis can tell. A call is assumed to return.
+ *
+ * chip8_cfg is large (about 60 KiB), so it is meant to be allocated by the caller once and
+ * reused.
+ */
+#define CHIP8_MAP_CODE 0x01
+#define CHIP8_MAP_INSN 0x02
+#define CHIP8_MAP_BLOCK 0x04
+#define CHIP8_MAP_SUBROUTINE 0x08
+#define CHIP8_MAP_COMPUTED 0x10
+#define CHIP8_MAP_DATA_REF 0x20
+
+#define CHIP8_BLOCK_RETURN 0x01
+#define CHIP8_BLOCK_COMPUTED 0x02
+#define CHIP8_BLOCK_CALL 0x04
+
+#define CHIP8_CFG_MAX_CALLS 1024
+
+struct chip8_block {
+	u16 start;
+	u16 end;
+	u16 succ[2];
+	u8 n_succ;
+	u8 flags;
+};
+
+struct chip8_call {
+	u16 caller;
+	u16 callee;
+};
+
+struct chip8_cfg {
+	u8 map[MEMORY_SIZE];
+	u16 n_blocks;
+	u16 n_calls;
+	struct chip8_block blocks[MEMORY_SIZE];
+	struct chip8_call calls[CHIP8_CFG_MAX_CALLS];
+};
+
+static u16 cfg_opcode(const u8 *memory, u16 addr)
+{
+	return (memory[addr] << 8) | memory[addr + 1];
+}
+
+static int cfg_is_skip(chip8_op op)
+{
+	return op == op_3xkk || op == op_4xkk || op == op_5xy0 || op == op_9xy0 || op == op_ex9e ||
+	       op == op_exa1;
+}
+
+/* Whether a whole instruction fits at addr. */
+static int cfg_has_insn(u16 addr)
+{
+	return addr <= MEMORY_SIZE - 2;
+}
+
+/*
+ * Pass one: mark everything reachable from entry. The work list holds addresses still to be
+ * walked; every address goes on it at most once, because it is marked CHIP8_MAP_INSN first.
+ */
+static void cfg_discover(struct chip8_cfg *cfg, const u8 *memory, u16 entry)
+{
+	u16 work[MEMORY_SIZE];
+	u16 n_work = 0;
+
+	if (!cfg_has_insn(entry)) {
+		return;
+	}
+	cfg->map[entry] |= CHIP8_MAP_BLOCK | CHIP8_MAP_SUBROUTINE;
+	work[n_work++] = entry;
+	cfg->map[entry] |= CHIP8_MAP_INSN;
+	while (n_work) {
+		u16 addr = work[--n_work];
+		u16 opcode = cfg_opcode(memory, addr);
+		chip8_op op = chip8_lookup(opcode);
+		u16 next[2];
+		u8 n_next = 0;
+		u8 i;
+
+		cfg->map[addr] |= CHIP8_MAP_CODE;
+		cfg->map[addr + 1] |= CHIP8_MAP_CODE;
+		if (op == op_1nnn) {
+			next[n_next++] = OPCODE_NNN(opcode);
+			cfg->map[OPCODE_NNN(opcode)] |= CHIP8_MAP_BLOCK;
+		} else if (op == op_2nnn) {
+			next[n_next++] = OPCODE_NNN(opcode);
+			next[n_next++] = addr + 2;
+			cfg->map[OPCODE_NNN(opcode)] |= CHIP8_MAP_BLOCK | CHIP8_MAP_SUBROUTINE;
+			if (addr + 2 < MEMORY_SIZE) {
+				cfg->map[addr + 2] |= CHIP8_MAP_BLOCK;
+			}
+		} else if (cfg_is_skip(op)) {
+			next[n_next++] = addr + 2;
+			next[n_next++] = addr + 4;
+			if (addr + 2 < MEMORY_SIZE) {
+				cfg->map[addr + 2] |= CHIP8_MAP_BLOCK;
+			}
+			if (addr + 4 < MEMORY_SIZE) {
+				cfg->map[addr + 4] |= CHIP8_MAP_BLOCK;
+			}
+		} else if (op == op_bnnn) {
+			cfg->map[addr] |= CHIP8_MAP_COMPUTED;
+		} else if (op != op_00ee) {
+			if (op == op_annn) {
+				cfg->map[OPCODE_NNN(opcode)] |= CHIP8_MAP_DATA_REF;
+			}
+			next[n_next++] = addr + 2;
+		}
+		for (i = 0; i < n_next; i++) {
+			if (cfg_has_insn(next[i]) && !(cfg->map[next[i]] & CHIP8_MAP_INSN)) {
+				cfg->map[next[i]] |= CHIP8_MAP_INSN;
+				work[n_work++] = next[i];
+			}
+		}
+	}
+}
+
+/*
+ * Pass two: cut the reachable code into blocks. A block runs from a block start up to and
+ * including its first control transfer, or up to the next block start.
+ */
+static void cfg_build_blocks(struct chip8_cfg *cfg, const u8 *memory)
+{
+	u32 start;
+
+	for (start = 0; start < MEMORY_SIZE; start++) {
+		struct chip8_block *block;
+		u16 addr = start;
+
+		if ((cfg->map[start] & (CHIP8_MAP_BLOCK | CHIP8_MAP_INSN)) !=
+		    (CHIP8_MAP_BLOCK | CHIP8_MAP_INSN)) {
+			continue;
+		}
+		block = &cfg->blocks[cfg->n_blocks++];
+		block->start = start;
+		block->n_succ = 0;
+		block->flags = 0;
+		for (;;) {
+			u16 opcode = cfg_opcode(memory, addr);
+			chip8_op op = chip8_lookup(opcode);
+
+			addr += 2;
+			if (op == op_1nnn) {
+				if (cfg_has_insn(OPCODE_NNN(opcode))) {
+					block->succ[block->n_succ++] = OPCODE_NNN(opcode);
+				}
+				break;
+			} else if (op == op_2nnn && cfg_has_insn(OPCODE_NNN(opcode))) {
+				block->flags |= CHIP8_BLOCK_CALL;
+				block->succ[block->n_succ++] = OPCODE_NNN(opcode);
+				if (cfg_has_insn(addr)) {
+					block->succ[block->n_succ++] = addr;
+				}
+				break;
+			} else if (cfg_is_skip(op)) {
+				if (cfg_has_insn(addr)) {
+					block->succ[block->n_succ++] = addr;
+				}
+				if (cfg_has_insn(addr + 2)) {
+					block->succ[block->n_succ++] = addr + 2;
+				}
+				break;
+			} else if (op == op_00ee) {
+				block->flags |= CHIP8_BLOCK_RETURN;
+				break;
+			} else if (op == op_bnnn) {
+				block->flags |= CHIP8_BLOCK_COMPUTED;
+				break;
+			} else if (!cfg_has_insn(addr)) {
+				break;
+			} else if (cfg->map[addr] & CHIP8_MAP_BLOCK) {
+				block->succ[block->n_succ++] = addr;
+				break;
+			}
+		}
+		block->end = addr;
+	}
+}
+
+/* The index of the block starting at addr, which must exist. */
+static u16 cfg_find_block(const struct chip8_cfg *cfg, u16 addr)
+{
+	u16 lo = 0;
+	u16 hi = cfg->n_blocks;
+
+	while (hi - lo > 1) {
+		u16 mid = (lo + hi) / 2;
+
+		if (cfg->blocks[mid].start <= addr) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * Pass three: for each subroutine, walk the blocks it can reach without entering a call and
+ * record one edge for every distinct subroutine it calls.
+ */
+static void cfg_build_calls(struct chip8_cfg *cfg)
+{
+	u8 seen[MEMORY_SIZE];
+	u16 work[MEMORY_SIZE];
+	u32 entry;
+
+	for (entry = 0; entry < MEMORY_SIZE; entry++) {
+		u16 n_work = 0;
+
+		if ((cfg->map[entry] & (CHIP8_MAP_SUBROUTINE | CHIP8_MAP_INSN)) !=
+		    (CHIP8_MAP_SUBROUTINE | CHIP8_MAP_INSN)) {
+			continue;
+		}
+		memset(seen, 0, sizeof(seen));
+		work[n_work++] = cfg_find_block(cfg, entry);
+		seen[entry] = 1;
+		while (n_work) {
+			const struct chip8_block *block = &cfg->blocks[work[--n_work]];
+			u8 i = 0;
+
+			if (block->flags & CHIP8_BLOCK_CALL) {
+				u16 callee = block->succ[0];
+				u16 j;
+
+				for (j = 0; j < cfg->n_calls; j++) {
+					if (cfg->calls[j].caller == entry && cfg->calls[j].callee == callee) {
+						break;
+					}
+				}
+				if (j == cfg->n_calls && cfg->n_calls < CHIP8_CFG_MAX_CALLS) {
+					cfg->calls[cfg->n_calls].caller = entry;
+					cfg->calls[cfg->n_calls].callee = callee;
+					cfg->n_calls++;
+				}
+				i = 1;
+			}
+			for (; i < block->n_succ; i++) {
+				u16 succ = block->succ[i];
+
+				if (!seen[succ]) {
+					seen[succ] = 1;
+					work[n_work++] = cfg_find_block(cfg, succ);
+				}
+			}
+		}
+	}
+}
+
+void chip8_analyze(struct chip8_cfg *cfg, const u8 *memory, u16 entry)
+{
+	memset(cfg->map, 0, sizeof(cfg->map));
+	cfg->n_blocks = 0;
+	cfg->n_calls = 0;
+	cfg_discover(cfg, memory, entry);
+	cfg_build_blocks(cfg, memory);
+	cfg_build_calls(cfg);
+}
+
+/* The block that holds the instruction at addr, or NULL if the walk never reached it. */
+const struct chip8_block *chip8_cfg_block(const struct chip8_cfg *cfg, u16 addr)
+{
+	const struct chip8_block *block;
+
+	if (addr >= MEMORY_SIZE || !(cfg->map[addr] & CHIP8_MAP_INSN) || !cfg->n_blocks) {
+		return NULL;
+	}
+	block = &cfg->blocks[cfg_find_block(cfg, addr)];
+	return addr >= block->start && addr < block->end ? block : NULL;
+}
+
+#ifdef CHIP8_PROFILE
+/*
+ * Profiling.
+ *
+ * Built with -DCHIP8_PROFILE, a machine with a chip8_profile attached counts the instructions it
+ * executes by opcode class, by address and as draw, ALU or control flow work. Counting happens
+ * where chip8_exec hands the instruction to its handler, so while a profile is attached every
+ * engine runs one instruction at a time through it, compiled JIT blocks are not used and idle
+ * loops are run instead of skipped, so a busy-looping program shows its loop as hot. The SoA
+ * lanes engine only counts the instructions it leaves to chip8_exec. Without the option none of
+ * this is compiled in.
+ */
+enum chip8_op_class {
+	CHIP8_OP_UNKNOWN,
+	CHIP8_OP_00CN, CHIP8_OP_00E0, CHIP8_OP_00EE, CHIP8_OP_00FB, CHIP8_OP_00FC, CHIP8_OP_00FE,
+	CHIP8_OP_00FF, CHIP8_OP_0NNN, CHIP8_OP_1NNN, CHIP8_OP_2NNN,
+	CHIP8_OP_3XKK, CHIP8_OP_4XKK, CHIP8_OP_5XY0, CHIP8_OP_6XKK, CHIP8_OP_7XKK,
+	CHIP8_OP_8XY0, CHIP8_OP_8XY1, CHIP8_OP_8XY2, CHIP8_OP_8XY3, CHIP8_OP_8XY4,
+	CHIP8_OP_8XY5, CHIP8_OP_8XY6, CHIP8_OP_8XY7, CHIP8_OP_8XYE, CHIP8_OP_9XY0,
+	CHIP8_OP_ANNN, CHIP8_OP_BNNN, CHIP8_OP_CXKK, CHIP8_OP_DXYN, CHIP8_OP_EX9E,
+	CHIP8_OP_EXA1, CHIP8_OP_FX07, CHIP8_OP_FX0A, CHIP8_OP_FX15, CHIP8_OP_FX18,
+	CHIP8_OP_FX1E, CHIP8_OP_FX29, CHIP8_OP_FX33, CHIP8_OP_FX55, CHIP8_OP_FX65,
+	CHIP8_OP_CLASSES
+};
+
+enum chip8_op_kind {
+	CHIP8_KIND_ALU,
+	CHIP8_KIND_DRAW,
+	CHIP8_KIND_CONTROL,
+	CHIP8_KINDS
+};
+
+struct chip8_profile {
+	u64 classes[CHIP8_OP_CLASSES];
+	u64 kinds[CHIP8_KINDS];
+	u64 pc[MEMORY_SIZE];
+};
+
+static const char *const op_class_names[CHIP8_OP_CLASSES] = {
+	"unknown",
+	"00Cn", "00E0", "00EE", "00FB", "00FC", "00FE", "00FF", "0nnn", "1nnn", "2nnn",
+	"3xkk", "4xkk", "5xy0", "6xkk", "7xkk",
+	"8xy0", "8xy1", "8xy2", "8xy3", "8xy4", "8xy5", "8xy6", "8xy7", "8xyE", "9xy0",
+	"Annn", "Bnnn", "Cxkk", "Dxyn", "Ex9E", "ExA1", "Fx07", "Fx0A", "Fx15", "Fx18",
+	"Fx1E", "Fx29", "Fx33", "Fx55", "Fx65",
+};
+
+static const char *const op_kind_names[CHIP8_KINDS] = { "alu", "draw", "control" };
+
+/* Every class is ALU work unless listed here. */
+static const u8 op_class_kinds[CHIP8_OP_CLASSES] = {
+	[CHIP8_OP_UNKNOWN] = CHIP8_KIND_CONTROL,
+	[CHIP8_OP_00CN] = CHIP8_KIND_DRAW,
+	[CHIP8_OP_00E0] = CHIP8_KIND_DRAW,
+	[CHIP8_OP_00FB] = CHIP8_KIND_DRAW,
+	[CHIP8_OP_00FC] = CHIP8_KIND_DRAW,
+	[CHIP8_OP_00FE] = CHIP8_KIND_DRAW,
+	[CHIP8_OP_00FF] = CHIP8_KIND_DRAW,
+	[CHIP8_OP_00EE] = CHIP8_KIND_CONTROL,
+	[CHIP8_OP_0NNN] = CHIP8_KIND_CONTROL,
+	[CHIP8_OP_1NNN] = CHIP8_KIND_CONTROL,
+	[CHIP8_OP_2NNN] = CHIP8_KIND_CONTROL,
+	[CHIP8_OP_3XKK] = CHIP8_KIND_CONTROL,
+	[CHIP8_OP_4XKK] = CHIP8_KIND_CONTROL,
+	[CHIP8_OP_5XY0] = CHIP8_KIND_CONTROL,
+	[CHIP8_OP_9XY0] = CHIP8_KIND_CONTROL,
+	[CHIP8_OP_BNNN] = CHIP8_KIND_CONTROL,
+	[CHIP8_OP_DXYN] = CHIP8_KIND_DRAW,
+	[CHIP8_OP_EX9E] = CHIP8_KIND_CONTROL,
+	[CHIP8_OP_EXA1] = CHIP8_KIND_CONTROL,
+	[CHIP8_OP_FX0A] = CHIP8_KIND_CONTROL,
+};
+
+/* Indexed by the first nibble, for the nibbles that are a single class. */
+static const u8 op_classes[16] = {
+	0, CHIP8_OP_1NNN, CHIP8_OP_2NNN, CHIP8_OP_3XKK, CHIP8_OP_4XKK, 0, CHIP8_OP_6XKK, CHIP8_OP_7XKK,
+	0, 0, CHIP8_OP_ANNN, CHIP8_OP_BNNN, CHIP8_OP_CXKK, CHIP8_OP_DXYN, 0, 0,
+};
+
+/*
+ * The class of opcode, CHIP8_OP_UNKNOWN for anything that decodes to op_unknown.
+ */
+enum chip8_op_class chip8_op_class(u16 opcode)
+{
+	switch (opcode >> 12) {
+	case 0x0:
+		switch (opcode) {
+		case 0x00E0:
+			return CHIP8_OP_00E0;
+		case 0x00EE:
+			return CHIP8_OP_00EE;
+		case 0x00FB:
+			return CHIP8_OP_00FB;
+		case 0x00FC:
+			return CHIP8_OP_00FC;
+		case 0x00FE:
+			return CHIP8_OP_00FE;
+		case 0x00FF:
+			return CHIP8_OP_00FF;
+		}
+		return (opcode & 0xFFF0) == 0x00C0 ? CHIP8_OP_00CN : CHIP8_OP_0NNN;
+	case 0x5:
+		return OPCODE_N(opcode) == 0 ? CHIP8_OP_5XY0 : CHIP8_OP_UNKNOWN;
+	case 0x8:
+		if (OPCODE_N(opcode) <= 0x7) {
+			return CHIP8_OP_8XY0 + OPCODE_N(opcode);
+		}
+		return OPCODE_N(opcode) == 0xE ? CHIP8_OP_8XYE : CHIP8_OP_UNKNOWN;
+	case 0x9:
+		return OPCODE_N(opcode) == 0 ? CHIP8_OP_9XY0 : CHIP8_OP_UNKNOWN;
+	case 0xE:
+		switch (OPCODE_KK(opcode)) {
+		case 0x9E:
+			return CHIP8_OP_EX9E;
+		case 0xA1:
+			return CHIP8_OP_EXA1;
+		}
+		return CHIP8_OP_UNKNOWN;
+	case 0xF:
+		switch (OPCODE_KK(opcode)) {
+		case 0x07:
+			return CHIP8_OP_FX07;
+		case 0x0A:
+			return CHIP8_OP_FX0A;
+		case 0x15:
+			return CHIP8_OP_FX15;
+		case 0x18:
+			return CHIP8_OP_FX18;
+		case 0x1E:
+			return CHIP8_OP_FX1E;
+		case 0x29:
+			return CHIP8_OP_FX29;
+		case 0x33:
+			return CHIP8_OP_FX33;
+		case 0x55:
+			return CHIP8_OP_FX55;
+		case 0x65:
+			return CHIP8_OP_FX65;
+		}
+		return CHIP8_OP_UNKNOWN;
+	default:
+		return op_classes[opcode >> 12];
+	}
+}
+
+static inline void profile_count(struct chip8_profile *profile, u16 pc, u16 opcode)
+{
+	enum chip8_op_class class = chip8_op_class(opcode);
+
+	profile->classes[class]++;
+	profile->kinds[op_class_kinds[class]]++;
+	profile->pc[pc & (MEMORY_SIZE - 1)]++;
+}
+
+/*
+ * Attach a caller-allocated profile to ch8, or detach it with NULL. The counters start at zero
+ * and keep counting until the profile is detached or attached again.
+ */
+void chip8_profile_attach(CHIP8 *ch8, struct chip8_profile *profile)
+{
+	ch8->profile = profile;
+	if (profile) {
+		memset(profile, 0, sizeof(*profile));
+	}
+}
+
+/*
+ * Write the counters to out as text: the instruction count of every class that ran, the share
+ * of draw, ALU and control flow, and the top_pcs most executed addresses.
+ */
+void chip8_profile_dump(const struct chip8_profile *profile, FILE *out, unsigned top_pcs)
+{
+	u64 total = 0;
+	u64 bound = UINT64_MAX;
+	int after = -1;
+	unsigned n;
+	int i;
+
+	for (i = 0; i < CHIP8_KINDS; i++) {
+		total += profile->kinds[i];
+	}
+	fprintf(out, "instructions %llu\n", (unsigned long long)total);
+	for (i = 0; i < CHIP8_KINDS; i++) {
+		fprintf(out, "%-8s %12llu %6.2f%%\n", op_kind_names[i],
+			(unsigned long long)profile->kinds[i],
+			total ? 100.0 * profile->kinds[i] / total : 0.0);
+	}
+	for (i = 0; i < CHIP8_OP_CLASSES; i++) {
+		if (profile->classes[i]) {
+			fprintf(out, "%-8s %12llu\n", op_class_names[i],
+				(unsigned long long)profile->classes[i]);
+		}
+	}
+	/* Hottest addresses first, ties in address order. */
+	for (n = 0; n < top_pcs; n++) {
+		int best = -1;
+
+		for (i = 0; i < MEMORY_SIZE; i++) {
+			u64 hits = profile->pc[i];
+
+			if (hits && (hits < bound || (hits == bound && i > after)) &&
+			    (best < 0 || hits > profile->pc[best])) {
+				best = i;
+			}
+		}
+		if (best < 0) {
+			break;
+		}
+		fprintf(out, "pc %03X   %12llu\n", best, (unsigned long long)profile->pc[best]);
+		bound = profile->pc[best];
+		after = best;
+	}
+}
+#endif
+
+static void chip8_step_uncached(CHIP8 *ch8)
+{
+	struct chip8_insn insn;
+
+	chip8_decode(chip8_fetch(ch8), &insn, ch8->quirks);
+	insn.handler(ch8, &insn);
+}
+
+/*
+ * Execute one instruction out of the decode cache. Odd program counters don't have an entry
+ * and are decoded on the fly.
+ */
+static inline void chip8_step_cached(CHIP8 *ch8)
+{
+	struct chip8_insn *insn;
+	u16 pc = CHIP8_ADDR(ch8->pc);
+
+	if (pc & 1) {
+		chip8_step_uncached(ch8);
+		return;
+	}
+	insn = &ch8->icache->entries[pc >> 1];
+	if (!insn->handler) {
+		chip8_decode((ch8->memory[pc] << 8) | ch8->memory[pc + 1], insn, ch8->quirks);
+	} else if (insn->len > 1) {
+		chip8_step_uncached(ch8);
+		return;
+	}
+	ch8->pc += 2;
+	insn->handler(ch8, insn);
+}
+
+#ifdef CHIP8_TRACE
+/*
+ * Instruction tracing.
+ *
+ * Built with -DCHIP8_TRACE, a machine with a chip8_trace attached appends one 16-byte record per
+ * instruction to a power-of-two ring, overwriting the oldest once it is full, so the last
+ * capacity instructions are always at hand after something goes wrong. Like profiling it runs
+ * every instruction through chip8_exec, idle loops included.
+ *
+ * The machine's thread is the only writer and never waits. chip8_trace_read may be called from
+ * any one other thread at the same time: it copies the newest records and then drops any that
+ * the writer may have overwritten while they were being copied.
+ *
+ * cycle is the low 32 bits of the machine's cycle counter after the instruction, and pc,
+ * opcode and I hold the address, the instruction and I afterwards. changed has bit k set if Vk
+ * was given a different value, vx and vf are Vx and VF afterwards, and flags tells whether I
+ * changed and whether pc did anything but move on by 2.
+ */
+#define CHIP8_TRACE_I_CHANGED 0x01
+#define CHIP8_TRACE_BRANCH 0x02
+
+struct chip8_trace_record {
+	u32 cycle;
+	u16 pc;
+	u16 opcode;
+	u16 I;
+	u16 changed;
+	u8 sp;
+	u8 vx;
+	u8 vf;
+	u8 flags;
+};
+
+struct chip8_trace {
+	struct chip8_trace_record *records;
+	u32 mask;
+	u64 head;
+};
+
+/*
+ * Allocate a ring that keeps at least the last capacity instructions. The slot the writer fills
+ * next is never read, so the ring is the next power of two above capacity. Returns -1 if
+ * capacity is 0 or too large, or the ring could not be allocated.
+ */
+int chip8_trace_init(struct chip8_trace *trace, u32 capacity)
+{
+	u32 size = 1;
+
+	if (!capacity || capacity >= 1u << 31) {
+		return -1;
+	}
+	while (size <= capacity) {
+		size <<= 1;
+	}
+	trace->records = malloc((size_t)size * sizeof(*trace->records));
+	if (!trace->records) {
+		return -1;
+	}
+	trace->mask = size - 1;
+	trace->head = 0;
+	return 0;
+}
+
+void chip8_trace_free(struct chip8_trace *trace)
+{
+	free(trace->records);
+	trace->records = NULL;
+}
+
+/*
+ * Attach an initialised trace to ch8, or detach it with NULL.
+ */
+void chip8_trace_attach(CHIP8 *ch8, struct chip8_trace *trace)
+{
+	ch8->trace = trace;
+}
+
+static inline void trace_record(struct chip8_trace *trace, const CHIP8 *ch8, u16 pc, u16 opcode,
+				u16 I, const u8 *V)
+{
+	u64 head = trace->head;
+	struct chip8_trace_record *r = &trace->records[head & trace->mask];
+	u16 changed = 0;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		changed |= (V[i] != ch8->V[i]) << i;
+	}
+	r->cycle = (u32)ch8->cycles;
+	r->pc = pc;
+	r->opcode = opcode;
+	r->I = ch8->I;
+	r->changed = changed;
+	r->sp = ch8->sp;
+	r->vx = ch8->V[OPCODE_X(opcode)];
+	r->vf = ch8->V[0xF];
+	r->flags = (ch8->I != I ? CHIP8_TRACE_I_CHANGED : 0) |
+		   (ch8->pc != (u16)(pc + 2) ? CHIP8_TRACE_BRANCH : 0);
+	__atomic_store_n(&trace->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copy up to max of the newest records to out, oldest first, and return how many were copied.
+ */
+u32 chip8_trace_read(const struct chip8_trace *trace, struct chip8_trace_record *out, u32 max)
+{
+	u64 size = (u64)trace->mask + 1;
+	u64 head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+	u64 first;
+	u64 safe;
+	u64 i;
+
+	if (max > head) {
+		max = (u32)head;
+	}
+	if (max > size - 1) {
+		max = (u32)(size - 1);
+	}
+	first = head - max;
+	for (i = first; i < head; i++) {
+		out[i - first] = trace->records[i & trace->mask];
+	}
+	/* Anything at or below the writer's current head minus the size may have been overwritten. */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	head = __atomic_load_n(&trace->head, __ATOMIC_RELAXED);
+	safe = head >= size ? head - size + 1 : 0;
+	if (first < safe) {
+		u64 drop = safe - first < max ? safe - first : max;
+
+		memmove(out, out + drop, (max - drop) * sizeof(*out));
+		max -= (u32)drop;
+	}
+	return max;
+}
+#endif
+
+#if defined(CHIP8_PROFILE) || defined(CHIP8_TRACE) || defined(CHIP8_CHECKED)
+#define CHIP8_HAVE_INSTRUMENTATION_
+
+static int chip8_instrumented(const CHIP8 *ch8)
+{
+#ifdef CHIP8_CHECKED
+	(void)ch8;
+	return 1;
+#endif
+#ifdef CHIP8_PROFILE
+	if (ch8->profile) {
+		return 1;
+	}
+#endif
+#ifdef CHIP8_TRACE
+	if (ch8->trace) {
+		return 1;
+	}
+#endif
+	return 0;
+}
+#endif
+
+/* Fetch, decode and execute a single instruction, without any of chip8_step's bookkeeping. */
+static void chip8_exec(CHIP8 *ch8)
+{
+#if defined(CHIP8_PROFILE) || defined(CHIP8_TRACE)
+	u16 pc = CHIP8_ADDR(ch8->pc);
+	u16 opcode;
+#endif
+#ifdef CHIP8_TRACE
+	struct chip8_trace *trace = ch8->trace;
+	u16 I = ch8->I;
+	u8 V[16];
+#endif
+
+	if (chip8_faulted(ch8) || chip8_trap(ch8, ch8->pc >= MEMORY_SIZE - 1, CHIP8_FAULT_PC)) {
+		return;
+	}
+#if defined(CHIP8_PROFILE) || defined(CHIP8_TRACE)
+	opcode = pc + 1 < MEMORY_SIZE ? (ch8->memory[pc] << 8) | ch8->memory[pc + 1] : 0;
+#endif
+#ifdef CHIP8_TRACE
+	if (trace) {
+		memcpy(V, ch8->V, 16);
+	}
+#endif
+#ifdef CHIP8_PROFILE
+	if (ch8->profile) {
+		profile_count(ch8->profile, pc, opcode);
+	}
+#endif
+	if (ch8->icache) {
+		chip8_step_cached(ch8);
+	} else {
+		chip8_step_uncached(ch8);
+	}
+#ifdef CHIP8_TRACE
+	if (trace) {
+		trace_record(trace, ch8, pc, opcode, I, V);
+	}
+#endif
+}
+
+#ifdef CHIP8_HAVE_INSTRUMENTATION_
+/* Run instructions one at a time through chip8_exec, with cycles exact for each of them. */
+static void chip8_run_instrumented(CHIP8 *ch8, u32 n_cycles)
+{
+	u64 end = ch8->cycles;
+
+	ch8->cycles -= n_cycles;
+	while (ch8->cycles != end && !chip8_faulted(ch8)) {
+		ch8->cycles++;
+		chip8_exec(ch8);
+	}
+}
+#endif
+
+/*
+ * Superinstructions.
+ *
+ * chip8_run_cached fuses three common sequences into the cache entry of their first
+ * instruction:
+ *
+ *   6xkk Annn Dxyn    load a coordinate, point I at a sprite and draw it
+ *   7xkk 3xkk 1nnn    count a register up to a limit and loop back
+ *   8xy0 8xy4         copy a register and add another to it
+ *
+ * A fused handler runs the same instr_* functions in order, taking the operands of the second
+ * and third instructions from the entries that follow its own, which are always decoded as
+ * plain instructions. Fusion changes only the first entry, so a jump into the middle of a
+ * sequence finds the plain entry there, and a single step (chip8_step_cached) runs a fused
+ * entry's first instruction alone. A write to any instruction of the sequence drops the fused
+ * entry with it (icache_invalidate).
+ *
+ * A fused handler returns the number of instructions it executed, so the cycle count stays
+ * exact. When the counted loop ends, 3xkk skips the 1nnn and only two have run.
+ */
+static u32 op_6xkk_annn_dxyn(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	ch8->pc += 4;
+	instr_6xkk_ld_vx_byte(ch8, insn[0].x, insn[0].kk);
+	instr_annn_ld_i_addr(ch8, insn[1].nnn);
+	instr_dxyn_drw_vx_vy_nibble(ch8, insn[2].x, insn[2].y, insn[2].n);
+	return 3;
+}
+
+static u32 op_7xkk_3xkk_1nnn(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	u16 pc;
+
+	instr_7xkk_add_vx_byte(ch8, insn[0].x, insn[0].kk);
+	pc = ch8->pc += 2;
+	instr_3xkk_se_vx_byte(ch8, insn[1].x, insn[1].kk);
+	if (ch8->pc != pc) {
+		return 2;
+	}
+	ch8->pc += 2;
+	instr_1nnn_jp_addr(ch8, insn[2].nnn);
+	return 3;
+}
+
+static u32 op_8xy0_8xy4(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	ch8->pc += 2;
+	instr_8xy0_ld_vx_vy(ch8, insn[0].x, insn[0].y);
+	instr_8xy4_add_vx_vy(ch8, insn[1].x, insn[1].y);
+	return 2;
+}
+
+static void icache_fuse(struct chip8_insn *insn, const u16 *opcodes, chip8_fused_op op, u8 len,
+			u8 quirks)
+{
+	u8 i;
+
+	for (i = 1; i < len; i++) {
+		if (!insn[i].handler) {
+			chip8_decode(opcodes[i], &insn[i], quirks);
+		}
+	}
+	insn->handler = fused_op(op);
+	insn->len = len;
+}
+
+/* Decode the entry for the even address pc, fusing it with what follows where possible. */
+static void icache_fill(CHIP8 *ch8, u16 pc)
+{
+	struct chip8_insn *insn = &ch8->icache->entries[pc >> 1];
+	u16 opcodes[3];
+	u16 i;
+
+	opcodes[0] = (ch8->memory[pc] << 8) | ch8->memory[pc + 1];
+	for (i = 1; i < 3 && pc + 2 * i < MEMORY_SIZE; i++) {
+		opcodes[i] = (ch8->memory[pc + 2 * i] << 8) | ch8->memory[pc + 2 * i + 1];
+	}
+	chip8_decode(opcodes[0], insn, ch8->quirks);
+	if (i == 3 && (opcodes[0] & 0xF000) == 0x6000 && (opcodes[1] & 0xF000) == 0xA000 &&
+	    (opcodes[2] & 0xF000) == 0xD000) {
+		icache_fuse(insn, opcodes, op_6xkk_annn_dxyn, 3, ch8->quirks);
+	} else if (i == 3 && (opcodes[0] & 0xF000) == 0x7000 && (opcodes[1] & 0xF000) == 0x3000 &&
+		   (opcodes[2] & 0xF000) == 0x1000) {
+		icache_fuse(insn, opcodes, op_7xkk_3xkk_1nnn, 3, ch8->quirks);
+	} else if (i >= 2 && (opcodes[0] & 0xF00F) == 0x8000 && (opcodes[1] & 0xF00F) == 0x8004) {
+		icache_fuse(insn, opcodes, op_8xy0_8xy4, 2, ch8->quirks);
+	}
+}
+
+static void chip8_run_cached(CHIP8 *ch8, u32 n_cycles)
+{
+	while (n_cycles) {
+		struct chip8_insn *insn;
+		u16 pc = CHIP8_ADDR(ch8->pc);
+		u8 len;
+
+		if (pc & 1) {
+			chip8_step_uncached(ch8);
+			n_cycles--;
+			continue;
+		}
+		insn = &ch8->icache->entries[pc >> 1];
+		if (!insn->handler) {
+			icache_fill(ch8, pc);
+		}
+		len = insn->len;
+		if (len > n_cycles) {
+			chip8_step_uncached(ch8);
+			n_cycles--;
+			continue;
+		}
+		ch8->pc += 2;
+		if (len == 1) {
+			insn->handler(ch8, insn);
+			n_cycles--;
+		} else {
+			n_cycles -= run_fused(ch8, insn);
+		}
+	}
+}
+
+/*
+ * Decode every even instruction address chip8_analyze found into the attached cache, so even the
+ * first pass through the program runs out of the cache, superinstructions included.
+ */
+void chip8_icache_prefill(CHIP8 *ch8, const struct chip8_cfg *cfg)
+{
+	u32 addr;
+
+	if (!ch8->icache) {
+		return;
+	}
+	for (addr = 0; addr < MEMORY_SIZE; addr += 2) {
+		if ((cfg->map[addr] & CHIP8_MAP_INSN) && !ch8->icache->entries[addr >> 1].handler) {
+			icache_fill(ch8, addr);
+		}
+	}
+}
+
+#ifdef CHIP8_JIT
+/*
+ * Basic-block JIT for x86-64.
+ *
+ * Straight-line runs of 6xkk, 7xkk and 8xyN are translated one-to-one into native code that
+ * operates on the CHIP8 struct in place (rdi holds ch8). A block ends at the first 1nnn, 3xkk,
+ * 4xkk, 5xy0 or 9xy0, which is compiled as the block's exit and stores the next pc, or just
+ * before the first instruction outside that subset, which is left to the interpreter.
+ *
+ * Blocks are keyed by their start address. Every write to a 256-byte page that holds compiled
+ * code drops the blocks overlapping the written byte, so self-modifying programs stay correct.
+ * The interpreter remains the fallback for everything else and the reference for what the
+ * generated code must do, including the order in which VF and Vx are written.
+ *
+ * The JIT runs on top of a decode cache, attaching its own when the machine has none: a compiled
+ * block is installed as the cache entry at its start address, one handler that calls it, and
+ * every other address runs the decoded instruction, so code the JIT leaves alone costs what it
+ * does without one. A block shorter than CHIP8_JIT_MIN_BLOCK instructions costs more to call than
+ * it saves and is not installed. A block is emitted into a scratch buffer first and only copied
+ * into the arena once it is known to be worth it, and only the arena pages it lands on are made
+ * writable, for as long as the copy takes.
+ */
+#define CHIP8_JIT_ARENA_SIZE (1 << 20)
+#define CHIP8_JIT_MIN_BLOCK 3
+#define CHIP8_JIT_MAX_BLOCK 64
+#define CHIP8_JIT_MAX_INSN_BYTES 48
+#define CHIP8_JIT_PAGE_SHIFT 8
+
+typedef u32 (*chip8_jit_fn)(CHIP8 *ch8);
+
+enum chip8_jit_state {
+	CHIP8_JIT_UNSEEN,
+	CHIP8_JIT_COMPILED,
+	CHIP8_JIT_UNCOMPILABLE,
+};
+
+struct chip8_jit_block {
+	chip8_jit_fn fn;
+	u16 bytes;
+	u8 len;
+	u8 state;
+};
+
+struct chip8_jit {
+	u8 *code;
+	size_t used;
+	u16 code_pages;
+	struct chip8_jit_block blocks[MEMORY_SIZE / 2];
+	struct chip8_icache icache;
+};
+
+struct chip8_jit *chip8_jit_create(void)
+{
+	struct chip8_jit *jit = calloc(1, sizeof(*jit));
+
+	if (!jit) {
+		return NULL;
+	}
+	jit->code = mmap(NULL, CHIP8_JIT_ARENA_SIZE, PROT_READ | PROT_EXEC,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (jit->code == MAP_FAILED) {
+		free(jit);
+		return NULL;
+	}
+	return jit;
+}
+
+void chip8_jit_destroy(struct chip8_jit *jit)
+{
+	if (!jit) {
+		return;
+	}
+	munmap(jit->code, CHIP8_JIT_ARENA_SIZE);
+	free(jit);
+}
+
+/* Drop every block. The cache entries that call them must be dropped with them. */
+static void chip8_jit_flush(struct chip8_jit *jit)
+{
+	memset(jit->blocks, 0, sizeof(jit->blocks));
+	jit->used = 0;
+	jit->code_pages = 0;
+}
+
+static void chip8_jit_invalidate(CHIP8 *ch8, u16 addr)
+{
+	struct chip8_jit *jit = ch8->jit;
+	int start;
+	int i;
+
+	if (!(jit->code_pages & (1u << (addr >> CHIP8_JIT_PAGE_SHIFT)))) {
+		return;
+	}
+	start = (addr >> 1) - CHIP8_JIT_MAX_BLOCK;
+	if (start < 0) {
+		start = 0;
+	}
+	for (i = start; i <= addr >> 1; i++) {
+		struct chip8_jit_block *block = &jit->blocks[i];
+
+		if (block->state != CHIP8_JIT_UNSEEN && (u32)i * 2 + block->bytes > addr) {
+			if (block->state == CHIP8_JIT_COMPILED && ch8->icache) {
+				ch8->icache->entries[i].handler = NULL;
+			}
+			block->state = CHIP8_JIT_UNSEEN;
+		}
+	}
+}
+
+static u8 *emit8(u8 *p, u8 b)
+{
+	*p++ = b;
+	return p;
+}
+
+static u8 *emit16(u8 *p, u16 w)
+{
+	p = emit8(p, w & 0xFF);
+	return emit8(p, w >> 8);
+}
+
+static u8 *emit32(u8 *p, u32 d)
+{
+	p = emit16(p, d & 0xFFFF);
+	return emit16(p, d >> 16);
+}
+
+/* <op> r8, byte [rdi + disp32], with the register encoded in the ModRM reg field. */
+static u8 *emit_mem(u8 *p, u8 op, u8 reg, u32 disp)
+{
+	p = emit8(p, op);
+	p = emit8(p, 0x80 | (reg << 3) | 7);
+	return emit32(p, disp);
+}
+
+#define REG_AL 0
+#define REG_CL 1
+#define REG_DL 2
+#define V_DISP(r) ((u32)(offsetof(CHIP8, V) + (r)))
+
+static u8 *emit_load(u8 *p, u8 reg, u8 r)
+{
+	return emit_mem(p, 0x8A, reg, V_DISP(r));
+}
+
+static u8 *emit_store(u8 *p, u8 reg, u8 r)
+{
+	return emit_mem(p, 0x88, reg, V_DISP(r));
+}
+
+/* <op> al, cl for the two-operand ALU forms encoded as <op> r/m8, r8. */
+static u8 *emit_alu(u8 *p, u8 op)
+{
+	p = emit8(p, op);
+	return emit8(p, 0xC8);
+}
+
+static u8 *emit_set_pc(u8 *p, u16 pc)
+{
+	p = emit8(p, 0x66);
+	p = emit_mem(p, 0xC7, 0, (u32)offsetof(CHIP8, pc));
+	return emit16(p, pc);
+}
+
+static u8 *emit_return(u8 *p, u32 count)
+{
+	p = emit8(p, 0xB8);
+	p = emit32(p, count);
+	return emit8(p, 0xC3);
+}
+
+/* Emit a flag-producing ALU op: VF is written before Vx, exactly like the instr_8xy* handlers. */
+static u8 *emit_flag_op(u8 *p, u8 x, u8 y, u8 n)
+{
+	switch (n) {
+	case 0x4:
+		p = emit_load(p, REG_AL, x);
+		p = emit_load(p, REG_CL, y);
+		p = emit_alu(p, 0x00);				/* add al, cl */
+		p = emit8(p, 0x0F), p = emit8(p, 0x92), p = emit8(p, 0xC2);	/* setc dl */
+		p = emit_store(p, REG_DL, 0xF);
+		return emit_store(p, REG_AL, x);
+	case 0x5:
+	case 0x7:
+		/* 8xy5: VF = Vx > Vy, Vx = Vx - Vy. 8xy7 is the same with the operands swapped. */
+		p = emit_load(p, REG_AL, n == 0x5 ? x : y);
+		p = emit_load(p, REG_CL, n == 0x5 ? y : x);
+		p = emit_alu(p, 0x38);				/* cmp al, cl */
+		p = emit8(p, 0x0F), p = emit8(p, 0x97), p = emit8(p, 0xC2);	/* seta dl */
+		p = emit_store(p, REG_DL, 0xF);
+		p = emit_load(p, REG_AL, n == 0x5 ? x : y);
+		p = emit_load(p, REG_CL, n == 0x5 ? y : x);
+		p = emit_alu(p, 0x28);				/* sub al, cl */
+		return emit_store(p, REG_AL, x);
+	case 0x6:
+		p = emit_load(p, REG_AL, x);
+		p = emit8(p, 0x24), p = emit8(p, 0x01);		/* and al, 1 */
+		p = emit_store(p, REG_AL, 0xF);
+		p = emit_load(p, REG_AL, x);
+		p = emit8(p, 0xD0), p = emit8(p, 0xE8);		/* shr al, 1 */
+		return emit_store(p, REG_AL, x);
+	default:
+		p = emit_load(p, REG_AL, x);
+		p = emit8(p, 0xC0), p = emit8(p, 0xE8), p = emit8(p, 0x07);	/* shr al, 7 */
+		p = emit_store(p, REG_AL, 0xF);
+		p = emit_load(p, REG_AL, x);
+		p = emit8(p, 0xD0), p = emit8(p, 0xE0);		/* shl al, 1 */
+		return emit_store(p, REG_AL, x);
+	}
+}
+
+/* Emit one ALU instruction, or return NULL if the opcode is outside the compiled subset. */
+static u8 *emit_alu_insn(u8 *p, u16 opcode)
+{
+	u8 x = OPCODE_X(opcode);
+	u8 y = OPCODE_Y(opcode);
+	u8 kk = OPCODE_KK(opcode);
+
+	switch (opcode >> 12) {
+	case 0x6:
+		p = emit_mem(p, 0xC6, 0, V_DISP(x));		/* mov byte [Vx], kk */
+		return emit8(p, kk);
+	case 0x7:
+		p = emit_mem(p, 0x80, 0, V_DISP(x));		/* add byte [Vx], kk */
+		return emit8(p, kk);
+	case 0x8:
+		switch (OPCODE_N(opcode)) {
+		case 0x0:
+			p = emit_load(p, REG_AL, y);
+			return emit_store(p, REG_AL, x);
+		case 0x1:
+		case 0x2:
+		case 0x3:
+			p = emit_load(p, REG_AL, x);
+			p = emit_load(p, REG_CL, y);
+			/* or / and / xor al, cl */
+			p = emit_alu(p, OPCODE_N(opcode) == 0x1 ? 0x08 : OPCODE_N(opcode) == 0x2 ? 0x20 : 0x30);
+			return emit_store(p, REG_AL, x);
+		case 0x4:
+		case 0x5:
+		case 0x6:
+		case 0x7:
+		case 0xE:
+			return emit_flag_op(p, x, y, OPCODE_N(opcode));
+		}
+		return NULL;
+	}
+	return NULL;
+}
+
+/*
+ * Emit the block exit for a jump or skip at addr. Returns NULL if the opcode does not end a
+ * block. Skips store addr + 2 and then conditionally overwrite it with addr + 4.
+ */
+static u8 *emit_exit_insn(u8 *p, u16 opcode, u16 addr, u32 count)
+{
+	u8 jcc;
+
+	switch (opcode >> 12) {
+	case 0x1:
+		p = emit_set_pc(p, OPCODE_NNN(opcode));
+		return emit_return(p, count);
+	case 0x3:
+	case 0x4:
+		p = emit_mem(p, 0x80, 7, V_DISP(OPCODE_X(opcode)));	/* cmp byte [Vx], kk */
+		p = emit8(p, OPCODE_KK(opcode));
+		jcc = (opcode >> 12) == 0x3 ? 0x75 : 0x74;
+		break;
+	case 0x5:
+	case 0x9:
+		if (OPCODE_N(opcode) != 0) {
+			return NULL;
+		}
+		p = emit_load(p, REG_AL, OPCODE_X(opcode));
+		p = emit_mem(p, 0x3A, REG_AL, V_DISP(OPCODE_Y(opcode)));	/* cmp al, [Vy] */
+		jcc = (opcode >> 12) == 0x5 ? 0x75 : 0x74;
+		break;
+	default:
+		return NULL;
+	}
+	p = emit_set_pc(p, addr + 2);
+	p = emit8(p, jcc);					/* jne/je over the taken skip */
+	p = emit8(p, 9);
+	p = emit_set_pc(p, addr + 4);
+	return emit_return(p, count);
+}
+
+/* Copy len bytes of code to the end of the arena, making only the pages it covers writable. */
+static int jit_install(struct chip8_jit *jit, const u8 *code, size_t len)
+{
+	uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+	uintptr_t first = (uintptr_t)(jit->code + jit->used) & ~(page - 1);
+	uintptr_t end = ((uintptr_t)(jit->code + jit->used + len) + page - 1) & ~(page - 1);
+
+	if (mprotect((void *)first, end - first, PROT_READ | PROT_WRITE) != 0) {
+		return -1;
+	}
+	memcpy(jit->code + jit->used, code, len);
+	if (mprotect((void *)first, end - first, PROT_READ | PROT_EXEC) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+static void chip8_jit_compile(struct chip8_jit *jit, CHIP8 *ch8, u16 pc)
+{
+	struct chip8_jit_block *block = &jit->blocks[pc >> 1];
+	u8 buf[CHIP8_JIT_MAX_BLOCK * CHIP8_JIT_MAX_INSN_BYTES];
+	u8 *p = buf;
+	u8 *next;
+	u16 addr = pc;
+	u32 count = 0;
+	int exited = 0;
+
+	while (count < CHIP8_JIT_MAX_BLOCK && addr + 1 < MEMORY_SIZE) {
+		u16 opcode = (ch8->memory[addr] << 8) | ch8->memory[addr + 1];
+
+		if (chip8_quirk_affects(ch8->quirks, opcode)) {
+			/* Only the default behaviour is compiled; the interpreter runs the others. */
+			break;
+		}
+		next = emit_alu_insn(p, opcode);
+		if (next) {
+			p = next;
+			addr += 2;
+			count++;
+			continue;
+		}
+		next = emit_exit_insn(p, opcode, addr, count + 1);
+		if (next) {
+			p = next;
+			addr += 2;
+			count++;
+			exited = 1;
+		}
+		break;
+	}
+	if (!exited) {
+		/* Ran into an instruction the JIT does not handle: hand control back just before it. */
+		p = emit_set_pc(p, addr);
+		p = emit_return(p, count);
+	}
+	if (count >= CHIP8_JIT_MIN_BLOCK && jit->used + (p - buf) > CHIP8_JIT_ARENA_SIZE) {
+		chip8_jit_flush(jit);
+		memset(ch8->icache, 0, sizeof(*ch8->icache));
+	}
+
+	/* A short block is dropped, and looked at again, like a compiled one when it is written. */
+	block->bytes = addr > pc ? addr - pc : 2;
+	block->len = count;
+	jit->code_pages |= 1u << (pc >> CHIP8_JIT_PAGE_SHIFT);
+	jit->code_pages |= 1u << ((pc + block->bytes - 1) >> CHIP8_JIT_PAGE_SHIFT);
+	if (count < CHIP8_JIT_MIN_BLOCK || jit_install(jit, buf, p - buf) != 0) {
+		block->state = CHIP8_JIT_UNCOMPILABLE;
+		return;
+	}
+	block->fn = (chip8_jit_fn)(void *)(jit->code + jit->used);
+	block->state = CHIP8_JIT_COMPILED;
+	jit->used += p - buf;
+}
+
+/* The cache entry for a compiled block: run the whole block, which leaves pc after it. */
+static u32 op_jit_block(CHIP8 *ch8, const struct chip8_insn *insn)
+{
+	return ch8->jit->blocks[insn - ch8->icache->entries].fn(ch8);
+}
+
+/* Fill the cache entry for pc with its compiled block if it has one, or else decode it. */
+static void jit_fill(CHIP8 *ch8, u16 pc)
+{
+	struct chip8_jit *jit = ch8->jit;
+	struct chip8_jit_block *block = &jit->blocks[pc >> 1];
+	struct chip8_insn *insn = &ch8->icache->entries[pc >> 1];
+
+	if (block->state == CHIP8_JIT_UNSEEN) {
+		chip8_jit_compile(jit, ch8, pc);
+	}
+	if (block->state == CHIP8_JIT_COMPILED) {
+		insn->handler = fused_op(op_jit_block);
+		insn->len = block->len;
+	} else {
+		icache_fill(ch8, pc);
+	}
+}
+
+/*
+ * chip8_run_cached, filling the cache through the JIT. A block is only entered when it fits in
+ * the remaining cycle budget, so n_cycles stays exact.
+ */
+static void chip8_run_jit(CHIP8 *ch8, u32 n_cycles)
+{
+	if (!ch8->icache) {
+		chip8_icache_attach(ch8, &ch8->jit->icache);
+	}
+	while (n_cycles) {
+		struct chip8_insn *insn;
+		u16 pc = CHIP8_ADDR(ch8->pc);
+		u8 len;
+
+		if (pc & 1 || ch8->pc >= MEMORY_SIZE) {
+			/* Blocks store the pc they leave at, so they only run from where they start. */
+			chip8_step_uncached(ch8);
+			n_cycles--;
+			continue;
+		}
+		insn = &ch8->icache->entries[pc >> 1];
+		if (!insn->handler) {
+			jit_fill(ch8, pc);
+		}
+		len = insn->len;
+		if (len > n_cycles) {
+			chip8_step_uncached(ch8);
+			n_cycles--;
+			continue;
+		}
+		ch8->pc += 2;
+		if (len == 1) {
+			insn->handler(ch8, insn);
+			n_cycles--;
+		} else {
+			n_cycles -= run_fused(ch8, insn);
+		}
+	}
+}
+
+/*
+ * Attach a JIT created with chip8_jit_create, or detach it with NULL. A JIT caches code for
+ * a single machine's memory and should not be shared between machines. The JIT installs its
+ * blocks in the attached decode cache, which is emptied whenever a JIT comes or goes; without
+ * one, the first run attaches the JIT's own, which is detached again with the JIT.
+ */
+void chip8_jit_attach(CHIP8 *ch8, struct chip8_jit *jit)
+{
+	if (ch8->jit && ch8->icache == &ch8->jit->icache) {
+		chip8_icache_attach(ch8, NULL);
+	} else if (ch8->icache) {
+		memset(ch8->icache, 0, sizeof(*ch8->icache));
+	}
+	ch8->jit = jit;
+	if (jit) {
+		chip8_jit_flush(jit);
+	}
+}
+#endif
+
+/*
+ * Run a translated program for n_cycles, stepping the interpreter wherever it stops short. Once
+ * the program is detached, the rest of the cycles are interpreted.
+ */
+static void chip8_run_aot(CHIP8 *ch8, u32 n_cycles)
+{
+	while (n_cycles) {
+		if (ch8->aot) {
+			n_cycles -= ch8->aot->run(ch8, n_cycles);
+			if (!n_cycles) {
+				break;
+			}
+		}
+		chip8_exec(ch8);
+		n_cycles--;
+	}
+}
+
+/*
+ * Execute n_cycles instructions.
+ *
+ * With a translated program attached, it runs wherever it covers pc. With a JIT attached,
+ * compiled blocks run out of the decode cache wherever possible. With a decode cache attached,
+ * instructions run straight out of the cache. Otherwise the interpreter loop built for the
+ * machine's quirk profile runs, picked once per call. On GCC and Clang its first-level dispatch
+ * is done with computed gotos, which gives every opcode its own indirect branch and takes the
+ * call through op_table out of the loop. Define CHIP8_NO_COMPUTED_GOTO to build the portable
+ * table-driven loop instead; it wins over a CHIP8_COMPUTED_GOTO given on the command line.
+ */
+#if defined(CHIP8_NO_COMPUTED_GOTO)
+#undef CHIP8_COMPUTED_GOTO
+#elif !defined(CHIP8_COMPUTED_GOTO) && (defined(__GNUC__) || defined(__clang__))
+#define CHIP8_COMPUTED_GOTO
+#endif
+
+#ifdef CHIP8_COMPUTED_GOTO
+#define EXECUTE_DISPATCH() \
+	do { \
+		if (n_cycles-- == 0) { \
+			return; \
+		} \
+		opcode = chip8_fetch(ch8); \
+		goto *labels[opcode >> 12]; \
+	} while (0)
+
+/* The interpreter loop for one quirk profile. */
+#define CHIP8_EXECUTE_LOOP(p, quirks) \
+static void execute_##p(CHIP8 *ch8, u32 n_cycles) \
+{ \
+	static void *const labels[16] = { \
+		&&group, &&do_1nnn, &&do_2nnn, &&do_3xkk, &&do_4xkk, &&do_5xy0, &&do_6xkk, &&do_7xkk, \
+		&&group, &&do_9xy0, &&do_annn, &&do_bnnn, &&do_cxkk, &&do_dxyn, &&group, &&group, \
+	}; \
+	struct chip8_insn insn; \
+	u16 opcode; \
+ \
+	EXECUTE_DISPATCH(); \
+ \
+group: \
+	chip8_decode(opcode, &insn, quirks); \
+	insn.handler(ch8, &insn); \
+	EXECUTE_DISPATCH(); \
+do_1nnn: \
+	instr_1nnn_jp_addr(ch8, OPCODE_NNN(opcode)); \
+	EXECUTE_DISPATCH(); \
+do_2nnn: \
+	instr_2nnn_call_addr(ch8, OPCODE_NNN(opcode)); \
+	EXECUTE_DISPATCH(); \
+do_3xkk: \
+	instr_3xkk_se_vx_byte(ch8, OPCODE_X(opcode), OPCODE_KK(opcode)); \
+	EXECUTE_DISPATCH(); \
+do_4xkk: \
+	instr_4xkk_sne_vx_byte(ch8, OPCODE_X(opcode), OPCODE_KK(opcode)); \
+	EXECUTE_DISPATCH(); \
+do_5xy0: \
+	instr_5xy0_se_vx_vy(ch8, OPCODE_X(opcode), OPCODE_Y(opcode)); \
+	EXECUTE_DISPATCH(); \
+do_6xkk: \
+	instr_6xkk_ld_vx_byte(ch8, OPCODE_X(opcode), OPCODE_KK(opcode)); \
+	EXECUTE_DISPATCH(); \
+do_7xkk: \
+	instr_7xkk_add_vx_byte(ch8, OPCODE_X(opcode), OPCODE_KK(opcode)); \
+	EXECUTE_DISPATCH(); \
+do_9xy0: \
+	instr_9xy0_sne_vx_vy(ch8, OPCODE_X(opcode), OPCODE_Y(opcode)); \
+	EXECUTE_DISPATCH(); \
+do_annn: \
+	instr_annn_ld_i_addr(ch8, OPCODE_NNN(opcode)); \
+	EXECUTE_DISPATCH(); \
+do_bnnn: \
+	quirk_bnnn(ch8, OPCODE_NNN(opcode), quirks); \
+	EXECUTE_DISPATCH(); \
+do_cxkk: \
+	cxkk_rnd_vx_byte(ch8, OPCODE_X(opcode), OPCODE_KK(opcode)); \
+	EXECUTE_DISPATCH(); \
+do_dxyn: \
+	instr_dxyn_drw_vx_vy_nibble(ch8, OPCODE_X(opcode), OPCODE_Y(opcode), OPCODE_N(opcode)); \
+	EXECUTE_DISPATCH(); \
+}
+#else
+#define CHIP8_EXECUTE_LOOP(p, quirks) \
+static void execute_##p(CHIP8 *ch8, u32 n_cycles) \
+{ \
+	struct chip8_insn insn; \
+ \
+	while (n_cycles--) { \
+		chip8_decode(chip8_fetch(ch8), &insn, quirks); \
+		insn.handler(ch8, &insn); \
+	} \
+}
+#endif
+
+CHIP8_EXECUTE_LOOP(default, CHIP8_QUIRKS_DEFAULT)
+CHIP8_EXECUTE_LOOP(vip, CHIP8_QUIRKS_VIP)
+CHIP8_EXECUTE_LOOP(chip48, CHIP8_QUIRKS_CHIP48)
+CHIP8_EXECUTE_LOOP(schip, CHIP8_QUIRKS_SCHIP)
+
+static void chip8_execute(CHIP8 *ch8, u32 n_cycles)
+{
+#ifdef CHIP8_HAVE_INSTRUMENTATION_
+	if (chip8_instrumented(ch8)) {
+		chip8_run_instrumented(ch8, n_cycles);
+		return;
+	}
+#endif
+	if (ch8->aot) {
+		chip8_run_aot(ch8, n_cycles);
+		return;
+	}
+#ifdef CHIP8_JIT
+	if (ch8->jit) {
+		chip8_run_jit(ch8, n_cycles);
+		return;
+	}
+#endif
+	if (ch8->icache) {
+		chip8_run_cached(ch8, n_cycles);
+		return;
+	}
+	switch (ch8->quirks) {
+	case CHIP8_QUIRKS_VIP:
+		execute_vip(ch8, n_cycles);
+		break;
+	case CHIP8_QUIRKS_CHIP48:
+		execute_chip48(ch8, n_cycles);
+		break;
+	case CHIP8_QUIRKS_SCHIP:
+		execute_schip(ch8, n_cycles);
+		break;
+	default:
+		execute_default(ch8, n_cycles);
+		break;
+	}
+}
+
+/* Little-endian and LEB128 helpers shared by the input log, save states and rewind. */
+static u8 *put16(u8 *p, u16 v)
+{
+	p[0] = (u8)v;
+	p[1] = (u8)(v >> 8);
+	return p + 2;
+}
+
+static u16 get16(const u8 *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static u8 *put_varint(u8 *p, u64 v)
+{
+	while (v >= 0x80) {
+		*p++ = (u8)(v | 0x80);
+		v >>= 7;
+	}
+	*p++ = (u8)v;
+	return p;
+}
+
+static const u8 *get_varint(const u8 *p, u64 *v)
+{
+	int shift = 0;
+
+	*v = 0;
+	do {
+		*v |= (u64)(*p & 0x7F) << shift;
+		shift += 7;
+	} while (*p++ & 0x80);
+	return p;
+}
+
+#ifdef CHIP8_TRACE
+/*
+ * Trace files start with "C8TR", a version byte, three zero bytes and the record count as a
+ * 32-bit value, followed by the records in order. Every field is little-endian and records are
+ * CHIP8_TRACE_RECORD_SIZE bytes, laid out like struct chip8_trace_record without padding.
+ */
+#define CHIP8_TRACE_VERSION 1
+#define CHIP8_TRACE_HEADER_SIZE 12
+#define CHIP8_TRACE_RECORD_SIZE 16
+
+static u8 *put32(u8 *p, u32 v)
+{
+	p = put16(p, (u16)v);
+	return put16(p, (u16)(v >> 16));
+}
+
+/*
+ * Write n records to buf as a trace file. Returns the size written, or 0 if len is too small.
+ */
+size_t chip8_trace_save(const struct chip8_trace_record *records, u32 n, u8 *buf, size_t len)
+{
+	u8 *p = buf;
+	u32 i;
+
+	if (len < CHIP8_TRACE_HEADER_SIZE ||
+	    (len - CHIP8_TRACE_HEADER_SIZE) / CHIP8_TRACE_RECORD_SIZE < n) {
+		return 0;
+	}
+	memcpy(p, "C8TR", 4);
+	p[4] = CHIP8_TRACE_VERSION;
+	memset(p + 5, 0, 3);
+	p = put32(p + 8, n);
+	for (i = 0; i < n; i++) {
+		const struct chip8_trace_record *r = &records[i];
+
+		p = put32(p, r->cycle);
+		p = put16(p, r->pc);
+		p = put16(p, r->opcode);
+		p = put16(p, r->I);
+		p = put16(p, r->changed);
+		*p++ = r->sp;
+		*p++ = r->vx;
+		*p++ = r->vf;
+		*p++ = r->flags;
+	}
+	return p - buf;
+}
+#endif
+
+/*
+ * Input recording and replay.
+ *
+ * While recording, chip8_set_key appends one event per keypad transition: the number of cycles
+ * since the previous event as a LEB128 varint, then one byte holding the key in the low nibble
+ * and the new state in bit 4. Nothing is written while the keypad does not change, and running
+ * the machine costs nothing extra.
+ *
+ * While replaying, chip8_run stops at the cycle of each event, applies it and carries on, so the
+ * program sees every transition at the exact cycle it was recorded at. Live chip8_set_key calls
+ * are ignored. Combined with the per-machine RND state, a replay from the same starting state is
+ * bit-exact.
+ *
+ * A log starts with "C8IN", a version byte and the keypad bitmask at the start of recording.
+ */
+#define CHIP8_INPUT_VERSION 1
+#define CHIP8_INPUT_HEADER_SIZE 7
+
+struct chip8_input_log {
+	u8 *data;
+	size_t len;
+	size_t cap;
+	size_t pos;
+	u64 base;
+	u64 last;
+	u64 next;
+	u8 next_event;
+	int replaying;
+	int has_next;
+};
+
+static int input_append(struct chip8_input_log *log, const u8 *src, size_t len)
+{
+	if (log->len + len > log->cap) {
+		size_t cap = log->cap ? log->cap * 2 : 256;
+		u8 *data = realloc(log->data, cap);
+
+		if (!data) {
+			return -1;
+		}
+		log->data = data;
+		log->cap = cap;
+	}
+	memcpy(log->data + log->len, src, len);
+	log->len += len;
+	return 0;
+}
+
+/* Read the next event, or end the log if it is used up or cut off inside an event. */
+static void input_fetch_next(struct chip8_input_log *log)
+{
+	size_t end = log->pos;
+	u64 delta;
+
+	while (end < log->len && log->data[end] & 0x80) {
+		end++;
+	}
+	log->has_next = end + 1 < log->len;
+	if (!log->has_next) {
+		return;
+	}
+	log->pos = get_varint(log->data + log->pos, &delta) - log->data;
+	log->next_event = log->data[log->pos++];
+	log->next = log->last + delta;
+	log->last = log->next;
+}
+
+/* Apply every replayed event that is due at the current cycle. */
+static void input_replay_due(CHIP8 *ch8)
+{
+	struct chip8_input_log *log = ch8->input;
+
+	while (log->has_next && log->next <= ch8->cycles) {
+		keypad_update(ch8, log->next_event & 0x0F, (log->next_event >> 4) & 1);
+		input_fetch_next(log);
+	}
+}
+
+/*
+ * Start recording ch8's key transitions into log, which is reset. Returns -1 if the log could
+ * not be allocated.
+ */
+int chip8_record_start(CHIP8 *ch8, struct chip8_input_log *log)
+{
+	u8 header[CHIP8_INPUT_HEADER_SIZE];
+
+	memset(log, 0, sizeof(*log));
+	memcpy(header, "C8IN", 4);
+	header[4] = CHIP8_INPUT_VERSION;
+	put16(header + 5, keypad_mask(ch8));
+	if (input_append(log, header, sizeof(header)) != 0) {
+		return -1;
+	}
+	log->base = log->last = ch8->cycles;
+	ch8->input = log;
+	return 0;
+}
+
+/*
+ * Replay log on ch8 from its current cycle onwards. Returns -1 if log is not a valid input log.
+ */
+int chip8_replay_start(CHIP8 *ch8, struct chip8_input_log *log)
+{
+	if (log->len < CHIP8_INPUT_HEADER_SIZE || memcmp(log->data, "C8IN", 4) != 0 ||
+	    log->data[4] != CHIP8_INPUT_VERSION) {
+		return -1;
+	}
+	keypad_set_mask(ch8, get16(log->data + 5));
+	log->pos = CHIP8_INPUT_HEADER_SIZE;
+	log->base = log->last = ch8->cycles;
+	log->replaying = 1;
+	input_fetch_next(log);
+	ch8->input = log;
+	return 0;
+}
+
+/*
+ * Stop recording or replaying. The log keeps its contents and can be replayed or freed.
+ */
+void chip8_input_stop(CHIP8 *ch8)
+{
+	if (ch8->input) {
+		ch8->input->replaying = 0;
+	}
+	ch8->input = NULL;
+}
+
+void chip8_input_free(struct chip8_input_log *log)
+{
+	free(log->data);
+	memset(log, 0, sizeof(*log));
+}
+
+/*
+ * Press or release a key. Frontends should use this instead of writing the keypad directly so
+ * that the transition can be recorded. With CHIP8_PACKED_KEYPAD it may be called from another
+ * thread than the one running the machine, as long as no recording is active.
+ */
+void chip8_set_key(CHIP8 *ch8, u8 key, u8 pressed)
+{
+	struct chip8_input_log *log = ch8->input;
+	u8 event[11];
+	u8 *p;
+
+	key &= 0x0F;
+	pressed = pressed != 0;
+	if (log && log->replaying) {
+		return;
+	}
+	if (keypad_update(ch8, key, pressed) == pressed || !log) {
+		return;
+	}
+	p = put_varint(event, ch8->cycles - log->last);
+	*p++ = key | (pressed << 4);
+	if (input_append(log, event, p - event) == 0) {
+		log->last = ch8->cycles;
+	}
+}
+
+/*
+ * Execute n_cycles instructions and advance the cycle counter.
+ */
+void chip8_run(CHIP8 *ch8, u32 n_cycles)
+{
+	struct chip8_input_log *log = ch8->input;
+
+	if (!log || !log->replaying) {
+		ch8->cycles += n_cycles;
+		chip8_execute(ch8, n_cycles);
+		return;
+	}
+	while (n_cycles) {
+		u32 chunk = n_cycles;
+
+		input_replay_due(ch8);
+		if (log->has_next && log->next - ch8->cycles < chunk) {
+			chunk = (u32)(log->next - ch8->cycles);
+		}
+		ch8->cycles += chunk;
+		chip8_execute(ch8, chunk);
+		n_cycles -= chunk;
+	}
+}
+
+/*
+ * Fetch, decode and execute a single instruction.
+ */
+void chip8_step(CHIP8 *ch8)
+{
+	if (chip8_faulted(ch8)) {
+		return;
+	}
+	if (ch8->input && ch8->input->replaying) {
+		input_replay_due(ch8);
+	}
+	ch8->cycles++;
+	chip8_exec(ch8);
+}
+
+
+/*
+ * Timers and frame scheduling.
+ *
+ * chip8_tick counts both timers down by one, as the 60 Hz timer interrupt does. A chip8_clock
+ * spreads a rate of ips instructions per second over 60 Hz frames with an integer accumulator:
+ * each frame gets (acc + ips) / 60 instructions and keeps the remainder in acc, so a rate that
+ * is not a multiple of 60 is still hit exactly over every second.
+ *
+ * chip8_run_frames runs whole frames, each one followed by a tick. While the program is idle it
+ * skips ahead instead of executing: in an idle loop (see below) every pass leaves the same state
+ * while the timers and keypad hold still, so the rest of the frame can be accounted for at once.
+ * A run of frames that is idle throughout, such as a wait for a key or a "Fx07; 3xkk; 1nnn" delay
+ * timer poll, is skipped in closed form up to the tick that ends the wait. Skipped
+ * instructions still count towards cycles and leave the machine in exactly the state executing
+ * them would have, so recordings and replays stay bit-exact. Nothing is skipped while a profile or
+ * trace is attached, or in a checked build, so those see every idle instruction run.
+ */
+#define CHIP8_TIMER_HZ 60
+
+/* Instructions run between two checks for an idle loop. */
+#define CHIP8_IDLE_CHECK 128
+
+struct chip8_clock {
+	u32 ips;
+	u32 acc;
+};
+
+/*
+ * Set up clock to run ips instructions per second.
+ */
+void chip8_clock_init(struct chip8_clock *clock, u32 ips)
+{
+	clock->ips = ips;
+	clock->acc = 0;
+}
+
+/* Number of instructions in the next n frames, consuming them from the accumulator. */
+static u64 clock_advance(struct chip8_clock *clock, u64 n)
+{
+	u64 total = clock->acc + n * clock->ips;
+
+	clock->acc = total % CHIP8_TIMER_HZ;
+	return total / CHIP8_TIMER_HZ;
+}
+
+static void timers_advance(CHIP8 *ch8, u64 n)
+{
+	ch8->delay_timer = ch8->delay_timer > n ? ch8->delay_timer - n : 0;
+	ch8->sound_timer = ch8->sound_timer > n ? ch8->sound_timer - n : 0;
+}
+
+/*
+ * Count the delay and sound timers down by one, stopping at zero.
+ */
+void chip8_tick(CHIP8 *ch8)
+{
+	timers_advance(ch8, 1);
+}
+
+static u16 opcode_at(const CHIP8 *ch8, int addr)
+{
+	return (ch8->memory[addr] << 8) | ch8->memory[addr + 1];
+}
+
+/* Returns the address of the Fx07; 3xkk; 1nnn loop that pc is in, or -1. */
+static int delay_loop_start(const CHIP8 *ch8)
+{
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		int start = ch8->pc - 2 * i;
+		u16 ld;
+		u16 se;
+
+		if (start < 0 || start + 6 > MEMORY_SIZE) {
+			continue;
+		}
+		ld = opcode_at(ch8, start);
+		se = opcode_at(ch8, start + 2);
+		if ((ld & 0xF0FF) == 0xF007 && (se & 0xF000) == 0x3000 &&
+		    OPCODE_X(se) == OPCODE_X(ld) && opcode_at(ch8, start + 4) == (0x1000 | start)) {
+			return start;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Idle loops.
+ *
+ * A loop is idle when one pass through it, starting at pc, comes back to pc having done nothing
+ * but jumps, skips, key checks, Fx0A with no key down and Fx07. Those only read V, the delay
+ * timer and the keypad, and Fx07 writes the same value on every pass while the timer holds still,
+ * so every later pass takes the same path and leaves the same state. That covers a 1nnn jumping
+ * to itself, Fx0A waiting for a key, key polling loops and delay timer polls. Such a loop can only
+ * be left by a tick, a key event, or the host changing the machine.
+ */
+#define CHIP8_IDLE_MAX_LOOP 16
+
+#define CHIP8_IDLE 0x1
+#define CHIP8_WAIT_TIMER 0x2
+#define CHIP8_WAIT_KEY 0x4
+
+struct idle_loop {
+	u16 path[CHIP8_IDLE_MAX_LOOP];
+	u8 V[16];
+	u8 len;
+	u8 waits;
+};
+
+/* Walk one pass from pc with registers V, without running it. Returns 0 if it does not come back. */
+static int idle_loop_walk(const CHIP8 *ch8, const u8 *V, struct idle_loop *loop)
+{
+	u16 keys = keypad_mask(ch8);
+	u16 pc = ch8->pc;
+	int taken;
+
+	memcpy(loop->V, V, 16);
+	loop->waits = 0;
+	for (loop->len = 0; loop->len < CHIP8_IDLE_MAX_LOOP; loop->len++) {
+		u16 opcode;
+		u8 x;
+
+		if (pc + 1 >= MEMORY_SIZE) {
+			return 0;
+		}
+		loop->path[loop->len] = pc;
+		opcode = opcode_at(ch8, pc);
+		x = OPCODE_X(opcode);
+		taken = 0;
+		switch (opcode >> 12) {
+		case 0x1:
+			pc = OPCODE_NNN(opcode);
+			break;
+		case 0x3:
+			taken = loop->V[x] == OPCODE_KK(opcode);
+			break;
+		case 0x4:
+			taken = loop->V[x] != OPCODE_KK(opcode);
+			break;
+		case 0x5:
+		case 0x9:
+			if (OPCODE_N(opcode) != 0) {
+				return 0;
+			}
+			taken = (loop->V[x] == loop->V[OPCODE_Y(opcode)]) == ((opcode >> 12) == 0x5);
+			break;
+		case 0xE:
+			if (OPCODE_KK(opcode) != 0x9E && OPCODE_KK(opcode) != 0xA1) {
+				return 0;
+			}
+			taken = ((keys >> (loop->V[x] & 0x0F)) & 1) == (OPCODE_KK(opcode) == 0x9E);
+			loop->waits |= CHIP8_WAIT_KEY;
+			break;
+		case 0xF:
+			if (OPCODE_KK(opcode) == 0x07) {
+				loop->V[x] = ch8->delay_timer;
+				loop->waits |= CHIP8_WAIT_TIMER;
+			} else if (OPCODE_KK(opcode) == 0x0A && !keys && pc == ch8->pc) {
+				pc -= 2;
+				loop->waits |= CHIP8_WAIT_KEY;
+			} else {
+				return 0;
+			}
+			break;
+		default:
+			return 0;
+		}
+		if ((opcode >> 12) != 0x1) {
+			pc += taken ? 4 : 2;
+		}
+		if (pc == ch8->pc) {
+			loop->len++;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Returns 0 if pc is not in an idle loop. A pass that starts halfway through the loop still sees
+ * a Vx from before the last Fx07, so the loop only counts as idle if a second pass, starting
+ * from the registers the first one left, takes the same path and leaves the same registers.
+ */
+static int idle_loop_find(const CHIP8 *ch8, struct idle_loop *loop)
+{
+	struct idle_loop again;
+
+	return idle_loop_walk(ch8, ch8->V, loop) && idle_loop_walk(ch8, loop->V, &again) &&
+	       again.len == loop->len && !memcmp(again.path, loop->path, loop->len * sizeof(u16)) &&
+	       !memcmp(again.V, loop->V, 16);
+}
+
+/*
+ * Returns CHIP8_IDLE if ch8 is in an idle loop, together with CHIP8_WAIT_TIMER if the loop reads
+ * the delay timer and CHIP8_WAIT_KEY if it reads the keypad. With neither wait flag set the
+ * machine is stuck for good, though its timers still run. Returns 0 while it is doing work.
+ */
+unsigned chip8_idle_state(const CHIP8 *ch8)
+{
+	struct idle_loop loop;
+
+	if (!idle_loop_find(ch8, &loop)) {
+		return 0;
+	}
+	return CHIP8_IDLE | loop.waits;
+}
+
+/*
+ * If ch8 is idle, account for up to n of the idle instructions without running them and return
+ * how many were skipped. Returns 0 if ch8 has to be run normally, as it always does while it is
+ * instrumented. The skip never crosses a replayed input event.
+ */
+static u32 idle_skip(CHIP8 *ch8, u32 n)
+{
+	struct chip8_input_log *log = ch8->input;
+	struct idle_loop loop;
+	u32 done;
+
+#ifdef CHIP8_HAVE_INSTRUMENTATION_
+	if (chip8_instrumented(ch8)) {
+		return 0;
+	}
+#endif
+	if (log && log->replaying) {
+		input_replay_due(ch8);
+		if (log->has_next && log->next - ch8->cycles < n) {
+			n = (u32)(log->next - ch8->cycles);
+		}
+	}
+	if (!idle_loop_find(ch8, &loop) || n < loop.len) {
+		return 0;
+	}
+	done = n - n % loop.len;
+	memcpy(ch8->V, loop.V, 16);
+	ch8->cycles += done;
+	return done;
+}
+
+static void run_idle_aware(CHIP8 *ch8, u32 n)
+{
+	while (n && !chip8_faulted(ch8)) {
+		u32 chunk = idle_skip(ch8, n);
+
+		if (!chunk) {
+			chunk = n < CHIP8_IDLE_CHECK ? n : CHIP8_IDLE_CHECK;
+			chip8_run(ch8, chunk);
+		}
+		n -= chunk;
+	}
+}
+
+/* Skip n frames of a delay timer poll in closed form, up to the tick that lets it out. */
+static u64 delay_loop_skip_frames(CHIP8 *ch8, struct chip8_clock *clock, u64 n)
+{
+	u32 acc = clock->acc;
+	int start = delay_loop_start(ch8);
+	u64 total;
+	u64 last;
+	u64 frame;
+	u8 x;
+	u8 kk;
+
+	if (start != ch8->pc || !clock->ips) {
+		return 0;
+	}
+	x = OPCODE_X(opcode_at(ch8, start));
+	kk = ch8->memory[start + 3];
+	if (ch8->delay_timer == kk) {
+		return 0;
+	}
+	/* The loop sees every delay timer value down to, not including, kk. */
+	if (ch8->delay_timer > kk && n > (u64)(ch8->delay_timer - kk)) {
+		n = ch8->delay_timer - kk;
+	}
+	total = clock_advance(clock, n);
+	if (total) {
+		/* Vx holds the delay timer as read by the last Fx07, in the frame that ran it. */
+		last = total - 1 - (total - 1) % 3;
+		frame = ((last + 1) * CHIP8_TIMER_HZ - acc + clock->ips - 1) / clock->ips - 1;
+		ch8->V[x] = ch8->delay_timer > frame ? ch8->delay_timer - frame : 0;
+		ch8->pc = start + 2 * (total % 3);
+		ch8->cycles += total;
+	}
+	timers_advance(ch8, n);
+	return n;
+}
+
+/*
+ * Skip the longest run of whole frames, at most n, over which ch8 stays idle. Returns the
+ * number of frames skipped, ticks included, which is 0 while ch8 is instrumented.
+ */
+static u64 idle_skip_frames(CHIP8 *ch8, struct chip8_clock *clock, u64 n)
+{
+	struct idle_loop loop;
+	u64 total;
+
+#ifdef CHIP8_HAVE_INSTRUMENTATION_
+	if (chip8_instrumented(ch8)) {
+		return 0;
+	}
+#endif
+	if (ch8->input && ch8->input->replaying) {
+		return 0;
+	}
+	if (!idle_loop_find(ch8, &loop)) {
+		return 0;
+	}
+	if (loop.waits & CHIP8_WAIT_TIMER) {
+		return delay_loop_skip_frames(ch8, clock, n);
+	}
+	/* Nothing but a key event gets out, and there are none until the host sends one. */
+	total = clock_advance(clock, n);
+	ch8->pc = loop.path[total % loop.len];
+	ch8->cycles += total;
+	timers_advance(ch8, n);
+	return n;
+}
+
+/*
+ * Run n_frames 60 Hz frames at clock's rate, ticking the timers at the end of each frame.
+ * Returns chip8_idle_state at the end: while it is non-zero the host can sleep until the next
+ * tick, or until the next key event if only CHIP8_WAIT_KEY is set, instead of spinning. A host
+ * that slept through several frames passes them all in one call and they are skipped at once.
+ */
+unsigned chip8_run_frames(CHIP8 *ch8, struct chip8_clock *clock, u64 n_frames)
+{
+	while (n_frames && !chip8_faulted(ch8)) {
+		u64 skipped = n_frames > 1 ? idle_skip_frames(ch8, clock, n_frames) : 0;
+
+		if (skipped) {
+			n_frames -= skipped;
+			continue;
+		}
+		run_idle_aware(ch8, (u32)clock_advance(clock, 1));
+		chip8_tick(ch8);
+		n_frames--;
+	}
+	return chip8_idle_state(ch8);
+}
+
+/*
+ * Audio.
+ *
+ * The buzzer sounds while sound_timer is non-zero. chip8_run_frames_audio runs frames as
+ * chip8_run_frames does and renders each frame's share of the output, rate / 60 samples, into a
+ * chip8_audio ring in one batch once the frame is done. The frame runs in as many slices as it
+ * has samples, or instructions if there are fewer, and the buzzer is looked at after each slice,
+ * so an Fx18 switches the tone at the sample it executed in and the tick ends it on the frame
+ * boundary. Up to CHIP8_AUDIO_MAX_EDGES switches are kept per frame; a program toggling faster
+ * than that has its last ones merged.
+ *
+ * The ring has one producer, the emulation thread, and one consumer, normally the host's audio
+ * callback calling chip8_audio_read. Each side owns one index and publishes it with a release
+ * store, so neither ever waits for the other. A frame that doesn't fit in the ring is cut short
+ * and the samples lost are added to overruns; a read asking for more than the ring holds gets
+ * the rest as silence, added to underruns.
+ *
+ * The tone is a square wave of tone_hz at plus or minus amplitude, CHIP8_AUDIO_TONE_HZ and
+ * CHIP8_AUDIO_AMPLITUDE by default, and its phase carries over from one frame to the next.
+ */
+#define CHIP8_AUDIO_TONE_HZ 440
+#define CHIP8_AUDIO_AMPLITUDE 8192
+#define CHIP8_AUDIO_MAX_EDGES 64
+
+struct chip8_audio {
+	int16_t *samples;
+	u32 mask;
+	u32 head;
+	u32 tail;
+	u32 rate;
+	u32 acc;
+	u32 tone_hz;
+	u32 phase;
+	int16_t amplitude;
+	u32 n_edges;
+	u32 edges[CHIP8_AUDIO_MAX_EDGES];
+	u64 overruns;
+	u64 underruns;
+};
+
+/*
+ * Set up audio to produce rate samples per second into a ring of at least capacity samples.
+ * Returns 0 on success and -1 on bad arguments or if the ring could not be allocated.
+ */
+int chip8_audio_init(struct chip8_audio *audio, u32 rate, u32 capacity)
+{
+	u32 size = 1;
+
+	memset(audio, 0, sizeof(*audio));
+	if (!rate || !capacity || capacity > 1u << 31) {
+		return -1;
+	}
+	while (size < capacity) {
+		size <<= 1;
+	}
+	audio->samples = malloc((size_t)size * sizeof(*audio->samples));
+	if (!audio->samples) {
+		return -1;
+	}
+	audio->mask = size - 1;
+	audio->rate = rate;
+	audio->tone_hz = CHIP8_AUDIO_TONE_HZ;
+	audio->amplitude = CHIP8_AUDIO_AMPLITUDE;
+	return 0;
+}
+
+void chip8_audio_free(struct chip8_audio *audio)
+{
+	free(audio->samples);
+	audio->samples = NULL;
+}
+
+/* Write count samples of one level, tone or silence, to the ring from position at. */
+static void audio_fill(struct chip8_audio *audio, u32 at, u32 count, int on)
+{
+	u32 half = audio->rate / 2;
+	u32 i;
+
+	if (!on) {
+		u32 first = audio->mask + 1 - (at & audio->mask);
+
+		if (first > count) {
+			first = count;
+		}
+		memset(&audio->samples[at & audio->mask], 0, first * sizeof(*audio->samples));
+		memset(audio->samples, 0, (count - first) * sizeof(*audio->samples));
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		audio->samples[(at + i) & audio->mask] =
+			audio->phase < half ? audio->amplitude : -audio->amplitude;
+		audio->phase += audio->tone_hz;
+		if (audio->phase >= audio->rate) {
+			audio->phase -= audio->rate;
+		}
+	}
+}
+
+/* Render n samples starting at level on and switching at each recorded edge, then publish them. */
+static void audio_render(struct chip8_audio *audio, u32 n, int on)
+{
+	u32 head = audio->head;
+	u32 tail = __atomic_load_n(&audio->tail, __ATOMIC_ACQUIRE);
+	u32 room = audio->mask + 1 - (head - tail);
+	u32 count = n < room ? n : room;
+	u32 pos = 0;
+	u32 e;
+
+	for (e = 0; e <= audio->n_edges && pos < count; e++) {
+		u32 end = e < audio->n_edges ? audio->edges[e] : count;
+
+		if (end > count) {
+			end = count;
+		}
+		audio_fill(audio, head + pos, end - pos, on);
+		pos = end;
+		on = !on;
+	}
+	audio->overruns += n - count;
+	audio->n_edges = 0;
+	__atomic_store_n(&audio->head, head + count, __ATOMIC_RELEASE);
+}
+
+static void audio_edge(struct chip8_audio *audio, u32 at)
+{
+	if (audio->n_edges < CHIP8_AUDIO_MAX_EDGES) {
+		audio->edges[audio->n_edges++] = at;
+	} else {
+		/* Merge with the last edge: two switches cancel out. */
+		audio->n_edges--;
+	}
+}
+
+/*
+ * chip8_run_frames, rendering the buzzer of every frame into audio. Frames are run one at a
+ * time, so runs of idle frames are not skipped in closed form, only the idle loops within each
+ * frame.
+ */
+unsigned chip8_run_frames_audio(CHIP8 *ch8, struct chip8_clock *clock, struct chip8_audio *audio,
+				u64 n_frames)
+{
+	while (n_frames && !chip8_faulted(ch8)) {
+		u32 insns = (u32)clock_advance(clock, 1);
+		u32 samples = (audio->acc + audio->rate) / CHIP8_TIMER_HZ;
+		u32 slices = insns < samples ? insns : samples;
+		int start = ch8->sound_timer != 0;
+		int on = start;
+		u32 done = 0;
+		u32 k;
+
+		audio->acc = (audio->acc + audio->rate) % CHIP8_TIMER_HZ;
+		for (k = 1; k <= slices && !chip8_faulted(ch8); k++) {
+			u32 end = (u32)((u64)insns * k / slices);
+
+			run_idle_aware(ch8, end - done);
+			done = end;
+			if ((ch8->sound_timer != 0) != on) {
+				audio_edge(audio, (u32)((u64)samples * k / slices));
+				on = !on;
+			}
+		}
+		if (done < insns) {
+			run_idle_aware(ch8, insns - done);
+		}
+		audio_render(audio, samples, start);
+		chip8_tick(ch8);
+		n_frames--;
+	}
+	return chip8_idle_state(ch8);
+}
+
+/*
+ * Take up to n samples off the ring into out, for the consumer side. Returns how many there
+ * were; the rest of out is filled with silence and counted as an underrun.
+ */
+u32 chip8_audio_read(struct chip8_audio *audio, int16_t *out, u32 n)
+{
+	u32 tail = audio->tail;
+	u32 head = __atomic_load_n(&audio->head, __ATOMIC_ACQUIRE);
+	u32 avail = head - tail;
+	u32 count = n < avail ? n : avail;
+	u32 first = audio->mask + 1 - (tail & audio->mask);
+
+	if (first > count) {
+		first = count;
+	}
+	memcpy(out, &audio->samples[tail & audio->mask], first * sizeof(*out));
+	memcpy(out + first, audio->samples, (count - first) * sizeof(*out));
+	__atomic_store_n(&audio->tail, tail + count, __ATOMIC_RELEASE);
+	if (count < n) {
+		memset(out + count, 0, (n - count) * sizeof(*out));
+		audio->underruns += n - count;
+	}
+	return count;
+}
+
+
+/*
+ * Frame publication.
+ *
+ * A renderer on another thread cannot read ch8->display while the emulation thread may be in
+ * the middle of a DRW. chip8_frames hands finished frames over through three slots instead:
+ * the producer owns one it fills, the consumer owns one it reads, and the third sits in
+ * between holding the newest complete frame. chip8_frames_publish copies the display into its
+ * slot and swaps it for the one in between with a single atomic exchange; chip8_frames_latest
+ * swaps its own slot for that one if a newer frame has been put there since. Neither side ever
+ * waits for the other, the producer never overwrites a frame being read, and a renderer slower
+ * than 60 Hz just skips the frames it missed.
+ *
+ * A chip8_frame is the packed 64x32 display and the hi-res flag, with seq counting the 60 Hz
+ * frames run. A renderer can compare seq with the frame it drew last to tell whether anything
+ * is new and how many frames it dropped. The hi-res displays are kept apart from the slots, one
+ * per slot, so a lo-res frame is a few hundred bytes; hires_display points at the slot's one and
+ * is only filled in while hires is set. The pointers are set by chip8_frames_init, so a
+ * chip8_frames must not be moved after it.
+ */
+#define CHIP8_FRAME_FRESH 4
+
+struct chip8_frame {
+	u64 seq;
+	u8 hires;
+	u8 display[DISPLAY_HEIGHT * DISPLAY_LENGTH / 8];
+	const u64 (*hires_display)[2];
+};
+
+struct chip8_frames {
+	struct chip8_frame slots[3];
+	u8 back;
+	u8 middle;
+	u8 front;
+	u64 seq;
+	u64 hires_displays[3][DISPLAY_HIRES_HEIGHT][2];
+};
+
+/*
+ * Set up frames with a blank frame of seq 0 in every slot.
+ */
+void chip8_frames_init(struct chip8_frames *frames)
+{
+	int i;
+
+	memset(frames, 0, sizeof(*frames));
+	for (i = 0; i < 3; i++) {
+		frames->slots[i].hires_display = (const u64 (*)[2])frames->hires_displays[i];
+	}
+	frames->middle = 1;
+	frames->front = 2;
+}
+
+/*
+ * Publish ch8's display as the next frame, for the producer side.
+ */
+void chip8_frames_publish(struct chip8_frames *frames, const CHIP8 *ch8)
+{
+	struct chip8_frame *frame = &frames->slots[frames->back];
+
+	frame->seq = ++frames->seq;
+	frame->hires = ch8->hires;
+	chip8_display_read(ch8, frame->display);
+	if (ch8->hires) {
+		memcpy(frames->hires_displays[frames->back], ch8->hires_display,
+		       sizeof(ch8->hires_display));
+	}
+	frames->back = __atomic_exchange_n(&frames->middle, frames->back | CHIP8_FRAME_FRESH,
+					   __ATOMIC_ACQ_REL) & 3;
+}
+
+/*
+ * The newest published frame, for the consumer side. It stays valid and unchanged until the
+ * next call.
+ */
+const struct chip8_frame *chip8_frames_latest(struct chip8_frames *frames)
+{
+	if (__atomic_load_n(&frames->middle, __ATOMIC_RELAXED) & CHIP8_FRAME_FRESH) {
+		frames->front = __atomic_exchange_n(&frames->middle, frames->front, __ATOMIC_ACQ_REL) & 3;
+	}
+	return &frames->slots[frames->front];
+}
+
+/*
+ * chip8_run_frames, publishing the display at the end of every frame. A run of idle frames
+ * skipped at once draws nothing, so it is published once, with seq moved on by the frames
+ * skipped.
+ */
+unsigned chip8_run_frames_publish(CHIP8 *ch8, struct chip8_clock *clock, struct chip8_frames *frames,
+				  u64 n_frames)
+{
+	while (n_frames && !chip8_faulted(ch8)) {
+		u64 skipped = n_frames > 1 ? idle_skip_frames(ch8, clock, n_frames) : 0;
+
+		if (skipped) {
+			n_frames -= skipped;
+			frames->seq += skipped - 1;
+		} else {
+			run_idle_aware(ch8, (u32)clock_advance(clock, 1));
+			chip8_tick(ch8);
+			n_frames--;
+		}
+		chip8_frames_publish(frames, ch8);
+	}
+	return chip8_idle_state(ch8);
+}
+
+/*
+ * Expand frame into dst as chip8_expand_display does for a machine.
+ */
+int chip8_expand_frame(const struct chip8_frame *frame, const struct chip8_surface *dst)
+{
+	u64 rows[DISPLAY_HEIGHT][2];
+	u8 row;
+	int i;
+
+	if (frame->hires) {
+		return expand_words(dst, frame->hires_display, DISPLAY_HIRES_HEIGHT, 2);
+	}
+	for (row = 0; row < DISPLAY_HEIGHT; row++) {
+		const u8 *p = &frame->display[row * (DISPLAY_LENGTH / 8)];
+
+		rows[row][0] = 0;
+		for (i = 0; i < DISPLAY_LENGTH / 8; i++) {
+			rows[row][0] = (rows[row][0] << 8) | p[i];
+		}
+	}
+	return expand_words(dst, (const u64 (*)[2])rows, DISPLAY_HEIGHT, 1);
+}
+
+/*
+ * ROM loading and reset.
+ *
+ * chip8_load_rom puts the font and a ROM into a machine's memory and points pc at the ROM. For
+ * machines that are reset over and over, chip8_image_init builds the whole power-on state once,
+ * font and ROM included, and chip8_reset then restores it with a single memcpy of everything up
+ * to the cycle counter. The counter, any attached cache, JIT, profile, trace or input log are
+ * kept, and cached code is dropped. A recording or replay should be restarted after a reset.
+ *
+ * On Unix hosts ROM files are mapped rather than read, so their contents are only copied once,
+ * straight into memory or the image.
+ */
+#define CHIP8_ROM_MAX (MEMORY_SIZE - PROGRAM_START_ADDRESS)
+
+static const u8 chip8_font[16 * FONT_SPRITE_SIZE] = {
+	0xF0, 0x90, 0x90, 0x90, 0xF0,	/* 0 */
+	0x20, 0x60, 0x20, 0x20, 0x70,	/* 1 */
+	0xF0, 0x10, 0xF0, 0x80, 0xF0,	/* 2 */
+	0xF0, 0x10, 0xF0, 0x10, 0xF0,	/* 3 */
+	0x90, 0x90, 0xF0, 0x10, 0x10,	/* 4 */
+	0xF0, 0x80, 0xF0, 0x10, 0xF0,	/* 5 */
+	0xF0, 0x80, 0xF0, 0x90, 0xF0,	/* 6 */
+	0xF0, 0x10, 0x20, 0x40, 0x40,	/* 7 */
+	0xF0, 0x90, 0xF0, 0x90, 0xF0,	/* 8 */
+	0xF0, 0x90, 0xF0, 0x10, 0xF0,	/* 9 */
+	0xF0, 0x90, 0xF0, 0x90, 0x90,	/* A */
+	0xE0, 0x90, 0xE0, 0x90, 0xE0,	/* B */
+	0xF0, 0x80, 0x80, 0x80, 0xF0,	/* C */
+	0xE0, 0x90, 0x90, 0x90, 0xE0,	/* D */
+	0xF0, 0x80, 0xF0, 0x80, 0xF0,	/* E */
+	0xF0, 0x80, 0xF0, 0x80, 0x80,	/* F */
+};
+
+struct chip8_image {
+	CHIP8 machine;
+};
+
+static void fill_memory(u8 *memory, const u8 *rom, size_t len)
+{
+	memset(memory, 0, MEMORY_SIZE);
+	memcpy(memory + FONT_ADDRESS, chip8_font, sizeof(chip8_font));
+	memcpy(memory + PROGRAM_START_ADDRESS, rom, len);
+}
+
+/* Drop everything decoded or compiled from ch8's memory. */
+static void drop_code(CHIP8 *ch8)
+{
+	if (ch8->icache) {
+		memset(ch8->icache, 0, sizeof(*ch8->icache));
+	}
+	if (ch8->aot && chip8_aot_attach(ch8, ch8->aot) != 0) {
+		ch8->aot = NULL;
+	}
+#ifdef CHIP8_JIT
+	if (ch8->jit) {
+		chip8_jit_flush(ch8->jit);
+	}
+#endif
+}
+
+/*
+ * Load the font and len bytes of rom into ch8, clearing the rest of memory, and set pc to the
+ * start of the ROM. Registers and the display are left alone. Returns -1 without touching ch8 if
+ * the ROM does not fit.
+ */
+int chip8_load_rom(CHIP8 *ch8, const u8 *rom, size_t len)
+{
+	if (len > CHIP8_ROM_MAX) {
+		return -1;
+	}
+	fill_memory(ch8->memory, rom, len);
+	/* All of memory was rewritten, not just the font and ROM pages. */
+	ch8->written_pages = (u16)~0u;
+	ch8->pc = PROGRAM_START_ADDRESS;
+	drop_code(ch8);
+	return 0;
+}
+
+/*
+ * Build the power-on state for rom in image: font and ROM in memory, pc at the ROM, everything
+ * else zero and the display marked dirty. Every page is marked written too, since a machine
+ * reset from the image no longer matches any state it was captured into. Returns -1 if the ROM
+ * does not fit.
+ */
+int chip8_image_init(struct chip8_image *image, const u8 *rom, size_t len)
+{
+	CHIP8 *m = &image->machine;
+
+	if (len > CHIP8_ROM_MAX) {
+		return -1;
+	}
+	memset(m, 0, sizeof(*m));
+	fill_memory(m->memory, rom, len);
+	m->written_pages = (u16)~0u;
+	m->pc = PROGRAM_START_ADDRESS;
+	m->dirty_rows = 0xFFFFFFFF;
+	return 0;
+}
+
+/*
+ * Seed the RND state every reset from image starts with.
+ */
+void chip8_image_seed(struct chip8_image *image, u64 seed)
+{
+	chip8_seed(&image->machine, seed);
+}
+
+/*
+ * Put ch8 back into the state held by image.
+ */
+void chip8_reset(CHIP8 *ch8, const struct chip8_image *image)
+{
+	memcpy(ch8, &image->machine, offsetof(CHIP8, cycles));
+	drop_code(ch8);
+}
+
+#ifdef CHIP8_MMAP
+/* Map the ROM at path. Returns -1 if it cannot be opened or mapped, or does not fit. */
+static int rom_map(const char *path, void **data, size_t *len)
+{
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0) {
+		return -1;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size < 0 || (u64)st.st_size > CHIP8_ROM_MAX) {
+		close(fd);
+		return -1;
+	}
+	*len = (size_t)st.st_size;
+	*data = NULL;
+	if (*len) {
+		*data = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	return *data == MAP_FAILED ? -1 : 0;
+}
+
+static void rom_unmap(void *data, size_t len)
+{
+	if (len) {
+		munmap(data, len);
+	}
+}
+
+/*
+ * chip8_load_rom for the ROM file at path.
+ */
+int chip8_load_rom_file(CHIP8 *ch8, const char *path)
+{
+	void *data;
+	size_t len;
+	int ret;
+
+	if (rom_map(path, &data, &len) != 0) {
+		return -1;
+	}
+	ret = chip8_load_rom(ch8, data, len);
+	rom_unmap(data, len);
+	return ret;
+}
+
+/*
+ * chip8_image_init for the ROM file at path.
+ */
+int chip8_image_init_file(struct chip8_image *image, const char *path)
+{
+	void *data;
+	size_t len;
+	int ret;
+
+	if (rom_map(path, &data, &len) != 0) {
+		return -1;
+	}
+	ret = chip8_image_init(image, data, len);
+	rom_unmap(data, len);
+	return ret;
+}
+#endif
+
+
+/*
+ * Batch execution.
+ *
+ * chip8_batch_run steps every machine of a contiguous array by the same number of cycles, one
+ * machine at a time so each one stays hot in cache while it runs. Machines share no state, so a
+ * batch can be split freely: with CHIP8_THREADS, a chip8_pool keeps worker threads around and
+ * chip8_pool_run hands out chunks of the array to them and to the calling thread.
+ *
+ * With CHIP8_EXTERN_RANDOM, get_random_byte is shared by all machines and has to be thread-safe
+ * when a pool is used.
+ */
+void chip8_batch_run(CHIP8 *machines, size_t n, u32 cycles)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		chip8_run(&machines[i], cycles);
+	}
+}
+
+#ifdef CHIP8_THREADS
+#define CHIP8_POOL_CHUNK 16
+
+struct chip8_pool {
+	pthread_t *threads;
+	unsigned n_threads;
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	u32 generation;
+	unsigned busy;
+	int quit;
+	CHIP8 *machines;
+	size_t n;
+	u32 cycles;
+	size_t next;
+};
+
+/* Claim chunks of the current batch until none are left. */
+static void chip8_pool_work(struct chip8_pool *pool)
+{
+	for (;;) {
+		size_t first = __atomic_fetch_add(&pool->next, CHIP8_POOL_CHUNK, __ATOMIC_RELAXED);
+
+		if (first >= pool->n) {
+			return;
+		}
+		chip8_batch_run(pool->machines + first,
+				pool->n - first < CHIP8_POOL_CHUNK ? pool->n - first : CHIP8_POOL_CHUNK,
+				pool->cycles);
+	}
+}
+
+static void *chip8_pool_worker(void *arg)
+{
+	struct chip8_pool *pool = arg;
+	u32 seen = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (pool->generation == seen && !pool->quit) {
+			pthread_cond_wait(&pool->start, &pool->lock);
+		}
+		if (pool->quit) {
+			break;
+		}
+		seen = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+
+		chip8_pool_work(pool);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->busy == 0) {
+			pthread_cond_signal(&pool->done);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/*
+ * Create a pool that runs batches on n_threads threads, the caller of chip8_pool_run included.
+ * n_threads == 0 uses one thread per online CPU. Returns NULL on failure.
+ */
+struct chip8_pool *chip8_pool_create(unsigned n_threads)
+{
+	struct chip8_pool *pool = calloc(1, sizeof(*pool));
+	unsigned i;
+
+	if (!pool) {
+		return NULL;
+	}
+	if (n_threads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		n_threads = cpus > 0 ? (unsigned)cpus : 1;
+	}
+	pool->threads = calloc(n_threads, sizeof(*pool->threads));
+	if (!pool->threads) {
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	for (i = 0; i + 1 < n_threads; i++) {
+		if (pthread_create(&pool->threads[i], NULL, chip8_pool_worker, pool) != 0) {
+			break;
+		}
+		pool->n_threads++;
+	}
+	return pool;
+}
+
+void chip8_pool_destroy(struct chip8_pool *pool)
+{
+	unsigned i;
+
+	if (!pool) {
+		return;
+	}
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->n_threads; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->start);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool);
+}
+
+/*
+ * Run every machine in machines[0..n) for cycles instructions, sharded across the pool.
+ * Returns once all of them are done.
+ */
+void chip8_pool_run(struct chip8_pool *pool, CHIP8 *machines, size_t n, u32 cycles)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->machines = machines;
+	pool->n = n;
+	pool->cycles = cycles;
+	pool->next = 0;
+	pool->busy = pool->n_threads;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	chip8_pool_work(pool);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->busy) {
+		pthread_cond_wait(&pool->done, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+#endif
+
+#ifdef CHIP8_SOA
+/*
+ * Structure-of-arrays lanes (experimental, -DCHIP8_SOA, GCC or Clang).
+ *
+ * The registers of CHIP8_LANES machines are kept as GCC vector-extension values, one element per
+ * lane, so every register access is a single SSE/AVX2/AVX-512/NEON operation depending on the
+ * target and CHIP8_LANES (16 lanes of u8 are one 128-bit vector, 32 lanes fill an AVX2 register).
+ *
+ * Every cycle executes one instruction on every lane: the first lane that has not run yet picks
+ * the opcode, every lane with the same opcode joins it, and the group runs as one masked vector
+ * operation. Lanes running the same ROM stay in one group most of the time, so a divergent
+ * branch only costs an extra pass. The ALU, skip, 1nnn and Annn groups are vectorized; every
+ * other opcode falls back to chip8_step on the lane's own machine, which also holds the memory,
+ * stack, keypad and display.
+ *
+ * The flag-setting groups write VF before Vx and re-read their inputs in between, exactly like
+ * instr_8xy4_add_vx_vy and friends, so the result matches the scalar interpreter even when x or
+ * y is F.
+ *
+ * None of the vectorized groups touch memory, so pc is the only thing they can take out of
+ * range. With CHIP8_CHECKED a lane whose pc is out of range is handed to chip8_exec, which traps
+ * it, and a faulted lane sits out every cycle, its cycle count included, until the fault is
+ * cleared and the lanes are loaded again.
+ */
+#if !(defined(__GNUC__) || defined(__clang__))
+#error "CHIP8_SOA needs GCC or Clang vector extensions"
+#endif
+
+#ifndef CHIP8_LANES
+#define CHIP8_LANES 16
+#endif
+
+typedef u8 lane_u8 __attribute__((vector_size(CHIP8_LANES)));
+typedef int8_t lane_s8 __attribute__((vector_size(CHIP8_LANES)));
+typedef u16 lane_u16 __attribute__((vector_size(CHIP8_LANES * 2)));
+typedef int16_t lane_s16 __attribute__((vector_size(CHIP8_LANES * 2)));
+
+struct chip8_lanes {
+	lane_u8 V[16];
+	lane_u16 I;
+	lane_u16 pc;
+	lane_u8 delay_timer;
+	lane_u8 sound_timer;
+	CHIP8 *machine[CHIP8_LANES];
+	u8 count;
+	u8 quirks;
+};
+
+/* Keep a where mask is set and b elsewhere. Macros, so they work for every lane type. */
+#define LANES_BLEND(mask, a, b) (((a) & (mask)) | ((b) & ~(mask)))
+#define LANES_WIDEN(mask) ((lane_u16)__builtin_convertvector((lane_s8)(mask), lane_s16))
+
+static void lanes_gather(struct chip8_lanes *lanes, int l)
+{
+	const CHIP8 *ch8 = lanes->machine[l];
+	int r;
+
+	for (r = 0; r < 16; r++) {
+		lanes->V[r][l] = ch8->V[r];
+	}
+	lanes->I[l] = ch8->I;
+	lanes->pc[l] = ch8->pc;
+	lanes->delay_timer[l] = ch8->delay_timer;
+	lanes->sound_timer[l] = ch8->sound_timer;
+}
+
+static void lanes_scatter(const struct chip8_lanes *lanes, int l)
+{
+	CHIP8 *ch8 = lanes->machine[l];
+	int r;
+
+	for (r = 0; r < 16; r++) {
+		ch8->V[r] = lanes->V[r][l];
+	}
+	ch8->I = lanes->I[l];
+	ch8->pc = lanes->pc[l];
+	ch8->delay_timer = lanes->delay_timer[l];
+	ch8->sound_timer = lanes->sound_timer[l];
+}
+
+/*
+ * Load up to CHIP8_LANES machines into lanes. The machines keep their memory, stack, keypad and
+ * display; call chip8_lanes_store to write the registers back. While any of them runs under a
+ * quirk profile, the instructions the profiles change are left to chip8_exec.
+ */
+void chip8_lanes_load(struct chip8_lanes *lanes, CHIP8 *machines, u8 count)
+{
+	int l;
+
+	memset(lanes, 0, sizeof(*lanes));
+	lanes->count = count > CHIP8_LANES ? CHIP8_LANES : count;
+	lanes->quirks = count ? machines[0].quirks : CHIP8_QUIRKS_DEFAULT;
+	for (l = 0; l < lanes->count; l++) {
+		lanes->machine[l] = &machines[l];
+		lanes_gather(lanes, l);
+		if (machines[l].quirks != machines[0].quirks) {
+			lanes->quirks = CHIP8_QUIRK_PROFILES;
+		}
+	}
+}
+
+void chip8_lanes_store(const struct chip8_lanes *lanes)
+{
+	int l;
+
+	for (l = 0; l < lanes->count; l++) {
+		lanes_scatter(lanes, l);
+	}
+}
+
+/* Masked 8xyN. Returns 0 for the N values that have no vector form. */
+static int lanes_exec_8(struct chip8_lanes *lanes, const lane_u8 *maskp, u8 x, u8 y, u8 n)
+{
+	lane_u8 *V = lanes->V;
+	lane_u8 mask = *maskp;
+	lane_u8 one = mask & 1;
+	lane_u8 vx = V[x];
+	lane_u8 vy = V[y];
+
+	switch (n) {
+	case 0x0:
+		V[x] = LANES_BLEND(mask, vy, vx);
+		return 1;
+	case 0x1:
+		V[x] = vx | (vy & mask);
+		return 1;
+	case 0x2:
+		V[x] = vx & (vy | ~mask);
+		return 1;
+	case 0x3:
+		V[x] = vx ^ (vy & mask);
+		return 1;
+	case 0x4: {
+		lane_u8 sum = vx + vy;
+
+		V[0xF] = LANES_BLEND(mask, (lane_u8)(sum < vx) & one, V[0xF]);
+		V[x] = LANES_BLEND(mask, sum, V[x]);
+		return 1;
+	}
+	case 0x5:
+		V[0xF] = LANES_BLEND(mask, (lane_u8)(vx > vy) & one, V[0xF]);
+		V[x] = LANES_BLEND(mask, V[x] - V[y], V[x]);
+		return 1;
+	case 0x6:
+		V[0xF] = LANES_BLEND(mask, vx & 0x01, V[0xF]);
+		V[x] = LANES_BLEND(mask, V[x] >> 1, V[x]);
+		return 1;
+	case 0x7:
+		V[0xF] = LANES_BLEND(mask, (lane_u8)(vy > vx) & one, V[0xF]);
+		V[x] = LANES_BLEND(mask, V[y] - V[x], V[x]);
+		return 1;
+	case 0xE:
+		V[0xF] = LANES_BLEND(mask, (vx >> 7) & 0x01, V[0xF]);
+		V[x] = LANES_BLEND(mask, V[x] << 1, V[x]);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Run opcode on every lane in mask. pc has already been advanced past the instruction.
+ * Returns 0 if the opcode has no vector form.
+ */
+static int lanes_exec(struct chip8_lanes *lanes, const lane_u8 *maskp, u16 opcode)
+{
+	lane_u8 mask = *maskp;
+	lane_u16 mask16 = LANES_WIDEN(mask);
+	lane_u8 vx = lanes->V[OPCODE_X(opcode)];
+	lane_u8 vy = lanes->V[OPCODE_Y(opcode)];
+	u8 kk = OPCODE_KK(opcode);
+	u16 nnn = OPCODE_NNN(opcode);
+	lane_u8 skip;
+
+	if (chip8_quirk_affects(lanes->quirks, opcode)) {
+		return 0;
+	}
+	switch (opcode >> 12) {
+	case 0x1:
+		lanes->pc = LANES_BLEND(mask16, lanes->pc - lanes->pc + nnn, lanes->pc);
+		return 1;
+	case 0x3:
+		skip = (lane_u8)(vx == kk);
+		break;
+	case 0x4:
+		skip = (lane_u8)(vx != kk);
+		break;
+	case 0x5:
+		if (OPCODE_N(opcode) != 0) {
+			return 0;
+		}
+		skip = (lane_u8)(vx == vy);
+		break;
+	case 0x6:
+		lanes->V[OPCODE_X(opcode)] = LANES_BLEND(mask, vx - vx + kk, vx);
+		return 1;
+	case 0x7:
+		lanes->V[OPCODE_X(opcode)] = vx + (mask & kk);
+		return 1;
+	case 0x8:
+		return lanes_exec_8(lanes, maskp, OPCODE_X(opcode), OPCODE_Y(opcode), OPCODE_N(opcode));
+	case 0x9:
+		if (OPCODE_N(opcode) != 0) {
+			return 0;
+		}
+		skip = (lane_u8)(vx != vy);
+		break;
+	case 0xA:
+		lanes->I = LANES_BLEND(mask16, lanes->I - lanes->I + nnn, lanes->I);
+		return 1;
+	default:
+		return 0;
+	}
+	lanes->pc += LANES_WIDEN(skip & mask) & 2;
+	return 1;
+}
+
+static void lanes_cycle(struct chip8_lanes *lanes)
+{
+	u16 opcode[CHIP8_LANES];
+	lane_u8 pending = { 0 };
+	int leader;
+	int l;
+
+	for (l = 0; l < lanes->count; l++) {
+		const u8 *memory = lanes->machine[l]->memory;
+
+#ifdef CHIP8_CHECKED
+		opcode[l] = 0;
+		if (chip8_faulted(lanes->machine[l])) {
+			continue;
+		}
+		lanes->machine[l]->cycles++;
+		if (lanes->pc[l] >= MEMORY_SIZE - 1) {
+			lanes_scatter(lanes, l);
+			chip8_exec(lanes->machine[l]);
+			lanes_gather(lanes, l);
+			continue;
+		}
+#endif
+		opcode[l] = (memory[CHIP8_ADDR(lanes->pc[l])] << 8) | memory[CHIP8_ADDR(lanes->pc[l] + 1)];
+		pending[l] = 0xFF;
+	}
+
+	for (leader = 0; leader < lanes->count; leader++) {
+		lane_u8 mask = { 0 };
+		u16 op = opcode[leader];
+
+		if (!pending[leader]) {
+			continue;
+		}
+		for (l = leader; l < lanes->count; l++) {
+			mask[l] = opcode[l] == op ? pending[l] : 0;
+		}
+		pending &= ~mask;
+
+		lanes->pc += LANES_WIDEN(mask) & 2;
+		if (lanes_exec(lanes, &mask, op)) {
+			continue;
+		}
+		for (l = leader; l < lanes->count; l++) {
+			if (!mask[l]) {
+				continue;
+			}
+			lanes->pc[l] -= 2;
+			lanes_scatter(lanes, l);
+			chip8_exec(lanes->machine[l]);
+			lanes_gather(lanes, l);
+		}
+	}
+}
+
+/*
+ * Run every loaded lane for cycles instructions.
+ */
+void chip8_lanes_run(struct chip8_lanes *lanes, u32 cycles)
+{
+#ifndef CHIP8_CHECKED
+	int l;
+
+	for (l = 0; l < lanes->count; l++) {
+		lanes->machine[l]->cycles += cycles;
+	}
+#endif
+	while (cycles--) {
+		lanes_cycle(lanes);
+	}
+}
+#endif
+
+
+/*
+ * Save states.
+ *
+ * chip8_snapshot serializes the machine into a compact, versioned byte format:
+ *
+ *	"C8SS", version, V[16], I, delay_timer, sound_timer, pc, sp, stack[16], keypad bitmask,
+ *	rng_state, page bitmask, the non-zero 256-byte memory pages, display (packed bytes),
+ *	hi-res flag, hi-res display (packed bytes, only when the flag is set)
+ *
+ * with every multi-byte field little-endian. Pages that are all zero are only recorded in the
+ * bitmask, which keeps a typical state well under the 4 KB of memory. Version 1 states end
+ * after the display and load as lo-res.
+ *
+ * For rewind and search, struct chip8_state is an in-memory snapshot that shares unchanged
+ * memory pages with the previous one. written_pages records which pages were stored to since
+ * the last chip8_state_capture or chip8_state_restore, and only those are copied; the rest just
+ * gain a reference. Anything else that rewrites memory, a rewind pop or a chip8_restore, leaves
+ * the pages it changed marked.
+ */
+#define CHIP8_SNAPSHOT_VERSION 2
+#define CHIP8_SNAPSHOT_REGS_SIZE (16 + 2 + 1 + 1 + 2 + 1 + 16 * 2 + 2 + 8)
+#define CHIP8_HIRES_SIZE (DISPLAY_HIRES_HEIGHT * DISPLAY_HIRES_LENGTH / 8)
+#define CHIP8_SNAPSHOT_MAX_SIZE (4 + 1 + CHIP8_SNAPSHOT_REGS_SIZE + 2 + MEMORY_SIZE + \
+				 DISPLAY_HEIGHT * DISPLAY_LENGTH / 8 + 1 + CHIP8_HIRES_SIZE)
+
+static int page_is_zero(const u8 *page)
+{
+	int i;
+
+	for (i = 0; i < MEMORY_PAGE_SIZE; i++) {
+		if (page[i]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static u8 *put_regs(u8 *p, const CHIP8 *ch8)
+{
+	int i;
+
+	memcpy(p, ch8->V, 16);
+	p += 16;
+	p = put16(p, ch8->I);
+	*p++ = ch8->delay_timer;
+	*p++ = ch8->sound_timer;
+	p = put16(p, ch8->pc);
+	*p++ = ch8->sp;
+	for (i = 0; i < 16; i++) {
+		p = put16(p, ch8->stack[i]);
+	}
+	p = put16(p, keypad_mask(ch8));
+	for (i = 0; i < 8; i++) {
+		*p++ = (u8)(ch8->rng_state >> (8 * i));
+	}
+	return p;
+}
+
+static const u8 *get_regs(const u8 *p, CHIP8 *ch8)
+{
+	int i;
+
+	memcpy(ch8->V, p, 16);
+	p += 16;
+	ch8->I = get16(p);
+	p += 2;
+	ch8->delay_timer = *p++;
+	ch8->sound_timer = *p++;
+	ch8->pc = get16(p);
+	p += 2;
+	ch8->sp = *p++;
+	for (i = 0; i < 16; i++, p += 2) {
+		ch8->stack[i] = get16(p);
+	}
+	keypad_set_mask(ch8, get16(p));
+	p += 2;
+	ch8->rng_state = 0;
+	for (i = 0; i < 8; i++) {
+		ch8->rng_state |= (u64)*p++ << (8 * i);
+	}
+	return p;
+}
+
+/* The hi-res display as packed bytes, DISPLAY_HIRES_LENGTH / 8 per row, leftmost pixel first. */
+static u8 *put_hires(u8 *p, const CHIP8 *ch8)
+{
+	int row;
+	int w;
+	int b;
+
+	for (row = 0; row < DISPLAY_HIRES_HEIGHT; row++) {
+		for (w = 0; w < 2; w++, p += 8) {
+			u64 bits = ch8->hires_display[row][w];
+
+			for (b = 7; b >= 0; b--) {
+				p[b] = (u8)bits;
+				bits >>= 8;
+			}
+		}
+	}
+	return p;
+}
+
+/* Load the hi-res display from put_hires bytes, marking the rows that change. */
+static const u8 *get_hires(const u8 *p, CHIP8 *ch8)
+{
+	int row;
+	int w;
+	int b;
+
+	for (row = 0; row < DISPLAY_HIRES_HEIGHT; row++) {
+		for (w = 0; w < 2; w++) {
+			u64 bits = 0;
+
+			for (b = 0; b < 8; b++) {
+				bits = (bits << 8) | *p++;
+			}
+			if (bits != ch8->hires_display[row][w]) {
+				ch8->hires_display[row][w] = bits;
+				ch8->hires_dirty_rows |= (u64)1 << row;
+			}
+		}
+	}
+	return p;
 }
 
+/* Copy page p of src into ch8, dropping cached code only if the contents actually change. */
+static void restore_page(CHIP8 *ch8, int page, const u8 *src)
+{
+	u8 *dst = &ch8->memory[page * MEMORY_PAGE_SIZE];
+
+	if (memcmp(dst, src, MEMORY_PAGE_SIZE) == 0) {
+		return;
+	}
+	memcpy(dst, src, MEMORY_PAGE_SIZE);
+	chip8_invalidate_code(ch8, page * MEMORY_PAGE_SIZE, MEMORY_PAGE_SIZE);
+}
 
 /*
- * Bnnn - JP V0, addr
- * Jump to location nnn + V0.
+ * Serialize ch8 into buf. Returns the number of bytes written, or 0 if len is too small;
+ * CHIP8_SNAPSHOT_MAX_SIZE is always enough.
+ */
+size_t chip8_snapshot(const CHIP8 *ch8, u8 *buf, size_t len)
+{
+	u8 tmp[CHIP8_SNAPSHOT_MAX_SIZE];
+	u8 *p = tmp;
+	u8 *mask;
+	u16 pages = 0;
+	int i;
+
+	memcpy(p, "C8SS", 4);
+	p += 4;
+	*p++ = CHIP8_SNAPSHOT_VERSION;
+	p = put_regs(p, ch8);
+	mask = p;
+	p += 2;
+	for (i = 0; i < MEMORY_PAGES; i++) {
+		if (!page_is_zero(&ch8->memory[i * MEMORY_PAGE_SIZE])) {
+			memcpy(p, &ch8->memory[i * MEMORY_PAGE_SIZE], MEMORY_PAGE_SIZE);
+			p += MEMORY_PAGE_SIZE;
+			pages |= 1u << i;
+		}
+	}
+	put16(mask, pages);
+	chip8_display_read(ch8, p);
+	p += DISPLAY_HEIGHT * DISPLAY_LENGTH / 8;
+	*p++ = ch8->hires;
+	if (ch8->hires) {
+		p = put_hires(p, ch8);
+	}
+
+	if ((size_t)(p - tmp) > len) {
+		return 0;
+	}
+	memcpy(buf, tmp, p - tmp);
+	return p - tmp;
+}
+
+/*
+ * Load a state written by chip8_snapshot into ch8. The attached caches stay attached and only
+ * lose the code on pages that differ. Returns 0 on success and -1 if buf is not a valid state,
+ * in which case ch8 is left untouched.
+ */
+int chip8_restore(CHIP8 *ch8, const u8 *buf, size_t len)
+{
+	static const u8 zero_page[MEMORY_PAGE_SIZE];
+	const u8 *p = buf;
+	u16 pages;
+	size_t need;
+	u8 hires = 0;
+	int i;
+
+	if (len < 4 + 1 + CHIP8_SNAPSHOT_REGS_SIZE + 2 || memcmp(p, "C8SS", 4) != 0 ||
+	    p[4] < 1 || p[4] > CHIP8_SNAPSHOT_VERSION) {
+		return -1;
+	}
+	/* sp, after V, I, the two timers and pc. CHIP8_SP does not mask it in a checked build. */
+	if (p[5 + 16 + 2 + 1 + 1 + 2] > 15) {
+		return -1;
+	}
+	pages = get16(p + 5 + CHIP8_SNAPSHOT_REGS_SIZE);
+	need = 4 + 1 + CHIP8_SNAPSHOT_REGS_SIZE + 2 + DISPLAY_HEIGHT * DISPLAY_LENGTH / 8;
+	for (i = 0; i < MEMORY_PAGES; i++) {
+		need += (pages >> i & 1) * MEMORY_PAGE_SIZE;
+	}
+	if (p[4] >= 2) {
+		if (len < need + 1) {
+			return -1;
+		}
+		hires = buf[need] != 0;
+		need += 1 + hires * CHIP8_HIRES_SIZE;
+	}
+	if (len < need) {
+		return -1;
+	}
+
+	p = get_regs(p + 5, ch8);
+	p += 2;
+	for (i = 0; i < MEMORY_PAGES; i++) {
+		if (pages >> i & 1) {
+			restore_page(ch8, i, p);
+			p += MEMORY_PAGE_SIZE;
+		} else {
+			restore_page(ch8, i, zero_page);
+		}
+	}
+	for (i = 0; i < DISPLAY_HEIGHT; i++, p += DISPLAY_LENGTH / 8) {
+		u64 bits = 0;
+		int b;
+
+		for (b = 0; b < DISPLAY_LENGTH / 8; b++) {
+			bits = (bits << 8) | p[b];
+		}
+		display_store_row(ch8, i, bits);
+	}
+	ch8->hires = hires;
+	if (hires) {
+		get_hires(p + 1, ch8);
+	}
+	ch8->dirty_rows = ~(u32)0;
+	ch8->hires_dirty_rows = ~(u64)0;
+	/* Memory now matches no captured state, so the next capture copies every page. */
+	ch8->written_pages = (u16)~0u;
+	return 0;
+}
+
+struct chip8_page {
+	u32 refs;
+	u8 data[MEMORY_PAGE_SIZE];
+};
+
+struct chip8_state {
+	struct chip8_page *pages[MEMORY_PAGES];
+	u8 regs[CHIP8_SNAPSHOT_REGS_SIZE];
+	u64 display[DISPLAY_HEIGHT];
+	u8 hires;
+	u64 hires_display[DISPLAY_HIRES_HEIGHT][2];
+};
+
+/*
+ * Capture ch8 into state. prev is the state this machine was last captured into or restored
+ * from, or NULL; pages that have not been written since then are shared with it instead of
+ * copied. Returns 0 on success and -1 if a page could not be allocated, in which case state
+ * holds no references.
+ */
+int chip8_state_capture(CHIP8 *ch8, const struct chip8_state *prev, struct chip8_state *state)
+{
+	int i;
+
+	for (i = 0; i < MEMORY_PAGES; i++) {
+		if (prev && !(ch8->written_pages >> i & 1)) {
+			state->pages[i] = prev->pages[i];
+			state->pages[i]->refs++;
+			continue;
+		}
+		state->pages[i] = malloc(sizeof(*state->pages[i]));
+		if (!state->pages[i]) {
+			while (i--) {
+				if (--state->pages[i]->refs == 0) {
+					free(state->pages[i]);
+				}
+			}
+			return -1;
+		}
+		state->pages[i]->refs = 1;
+		memcpy(state->pages[i]->data, &ch8->memory[i * MEMORY_PAGE_SIZE], MEMORY_PAGE_SIZE);
+	}
+	put_regs(state->regs, ch8);
+	for (i = 0; i < DISPLAY_HEIGHT; i++) {
+		state->display[i] = display_load_row(ch8, i);
+	}
+	state->hires = ch8->hires;
+	if (ch8->hires) {
+		memcpy(state->hires_display, ch8->hires_display, sizeof(state->hires_display));
+	}
+	ch8->written_pages = 0;
+	return 0;
+}
+
+/*
+ * Put ch8 back into a captured state. Pages shared with the current memory contents cost a
+ * compare, not a copy, and keep their cached code.
+ */
+void chip8_state_restore(CHIP8 *ch8, const struct chip8_state *state)
+{
+	int i;
+
+	for (i = 0; i < MEMORY_PAGES; i++) {
+		restore_page(ch8, i, state->pages[i]->data);
+	}
+	get_regs(state->regs, ch8);
+	for (i = 0; i < DISPLAY_HEIGHT; i++) {
+		display_store_row(ch8, i, state->display[i]);
+	}
+	ch8->hires = state->hires;
+	if (state->hires) {
+		memcpy(ch8->hires_display, state->hires_display, sizeof(ch8->hires_display));
+	}
+	ch8->dirty_rows = ~(u32)0;
+	ch8->hires_dirty_rows = ~(u64)0;
+	ch8->written_pages = 0;
+}
+
+void chip8_state_release(struct chip8_state *state)
+{
+	int i;
+
+	for (i = 0; i < MEMORY_PAGES; i++) {
+		if (state->pages[i] && --state->pages[i]->refs == 0) {
+			free(state->pages[i]);
+		}
+		state->pages[i] = NULL;
+	}
+}
+
+/*
+ * Rewind buffer.
  *
- * The program counter is set to nnn plus the value of V0.
+ * Every chip8_rewind_push turns the machine into a flat image (memory, registers, packed display,
+ * hi-res flag and hi-res display, zero in lo-res mode) and stores only the XOR of that image
+ * against the previous frame's image, run-length encoded as (zero run, literal run) pairs of
+ * LEB128 lengths followed by the literal XOR bytes. Typical frames change a few dozen bytes, so a
+ * record is a few dozen bytes, and minutes of 60 Hz history fit in a buffer of a few MB.
+ *
+ * Records go into a fixed-size byte ring as [length][delta][length]; the oldest records are
+ * dropped to make room. XOR is its own inverse, so chip8_rewind_pop applies the newest delta to
+ * the current image to get the previous frame back.
  */
-void instr_bnnn_jp_v0_addr(CHIP8 *ch8, u16 nnn)
+#define CHIP8_IMAGE_HIRES (MEMORY_SIZE + CHIP8_SNAPSHOT_REGS_SIZE + DISPLAY_HEIGHT * DISPLAY_LENGTH / 8)
+#define CHIP8_IMAGE_SIZE (CHIP8_IMAGE_HIRES + 1 + CHIP8_HIRES_SIZE)
+
+struct chip8_rewind {
+	u8 *ring;
+	size_t capacity;
+	size_t head;
+	size_t tail;
+	size_t used;
+	u32 frames;
+	int has_image;
+	u8 image[CHIP8_IMAGE_SIZE];
+	u8 scratch[2 * CHIP8_IMAGE_SIZE];
+};
+
+static void put_image(u8 *image, const CHIP8 *ch8)
+{
+	memcpy(image, ch8->memory, MEMORY_SIZE);
+	put_regs(image + MEMORY_SIZE, ch8);
+	chip8_display_read(ch8, image + MEMORY_SIZE + CHIP8_SNAPSHOT_REGS_SIZE);
+	image[CHIP8_IMAGE_HIRES] = ch8->hires;
+	if (ch8->hires) {
+		put_hires(image + CHIP8_IMAGE_HIRES + 1, ch8);
+	} else {
+		memset(image + CHIP8_IMAGE_HIRES + 1, 0, CHIP8_HIRES_SIZE);
+	}
+}
+
+static void get_image(CHIP8 *ch8, const u8 *image)
+{
+	const u8 *p = image + MEMORY_SIZE + CHIP8_SNAPSHOT_REGS_SIZE;
+	int i;
+
+	for (i = 0; i < MEMORY_PAGES; i++) {
+		restore_page(ch8, i, image + i * MEMORY_PAGE_SIZE);
+	}
+	get_regs(image + MEMORY_SIZE, ch8);
+	for (i = 0; i < DISPLAY_HEIGHT; i++, p += DISPLAY_LENGTH / 8) {
+		u64 bits = 0;
+		int b;
+
+		for (b = 0; b < DISPLAY_LENGTH / 8; b++) {
+			bits = (bits << 8) | p[b];
+		}
+		if (bits != display_load_row(ch8, i)) {
+			display_store_row(ch8, i, bits);
+			ch8->dirty_rows |= (u32)1 << i;
+		}
+	}
+	if (ch8->hires != image[CHIP8_IMAGE_HIRES]) {
+		ch8->hires = image[CHIP8_IMAGE_HIRES];
+		ch8->dirty_rows = ~(u32)0;
+		ch8->hires_dirty_rows = ~(u64)0;
+	}
+	if (ch8->hires) {
+		get_hires(image + CHIP8_IMAGE_HIRES + 1, ch8);
+	}
+}
+
+/* Encode cur ^ prev into out, returning the encoded size. */
+static size_t delta_encode(u8 *out, const u8 *cur, const u8 *prev)
+{
+	u8 *p = out;
+	u32 i = 0;
+
+	while (i < CHIP8_IMAGE_SIZE) {
+		u32 zeros = 0;
+		u32 start;
+
+		while (i < CHIP8_IMAGE_SIZE && cur[i] == prev[i]) {
+			i++;
+			zeros++;
+		}
+		if (i == CHIP8_IMAGE_SIZE) {
+			break;
+		}
+		start = i;
+		while (i < CHIP8_IMAGE_SIZE && cur[i] != prev[i]) {
+			i++;
+		}
+		p = put_varint(p, zeros);
+		p = put_varint(p, i - start);
+		for (; start < i; start++) {
+			*p++ = cur[start] ^ prev[start];
+		}
+	}
+	return p - out;
+}
+
+static void delta_apply(u8 *image, const u8 *delta, size_t len)
+{
+	const u8 *p = delta;
+	const u8 *end = delta + len;
+	u32 i = 0;
+
+	while (p < end) {
+		u64 zeros;
+		u64 run;
+
+		p = get_varint(p, &zeros);
+		p = get_varint(p, &run);
+		i += zeros;
+		while (run--) {
+			image[i++] ^= *p++;
+		}
+	}
+}
+
+static void ring_write(struct chip8_rewind *rw, const u8 *src, size_t len)
+{
+	size_t first = rw->capacity - rw->head < len ? rw->capacity - rw->head : len;
+
+	memcpy(rw->ring + rw->head, src, first);
+	memcpy(rw->ring, src + first, len - first);
+	rw->head = (rw->head + len) % rw->capacity;
+}
+
+static void ring_read(const struct chip8_rewind *rw, size_t at, u8 *dst, size_t len)
+{
+	size_t first = rw->capacity - at < len ? rw->capacity - at : len;
+
+	memcpy(dst, rw->ring + at, first);
+	memcpy(dst + first, rw->ring, len - first);
+}
+
+static u32 ring_read_len(const struct chip8_rewind *rw, size_t at)
 {
-	ch8->pc = nnn + ch8->V[0x0];
+	u8 b[4];
+
+	ring_read(rw, at % rw->capacity, b, 4);
+	return b[0] | (b[1] << 8) | (b[2] << 16) | ((u32)b[3] << 24);
 }
 
+static void ring_drop_oldest(struct chip8_rewind *rw)
+{
+	size_t size = 8 + ring_read_len(rw, rw->tail);
+
+	rw->tail = (rw->tail + size) % rw->capacity;
+	rw->used -= size;
+	rw->frames--;
+}
 
 /*
- * Cxkk - RND Vx, byte
- * Set Vx = random byte AND kk.
+ * Set up a rewind buffer holding capacity bytes of deltas. Returns 0 on success and -1 if the
+ * ring could not be allocated.
+ */
+int chip8_rewind_init(struct chip8_rewind *rw, size_t capacity)
+{
+	memset(rw, 0, offsetof(struct chip8_rewind, image));
+	rw->ring = malloc(capacity);
+	if (!rw->ring) {
+		return -1;
+	}
+	rw->capacity = capacity;
+	return 0;
+}
+
+void chip8_rewind_free(struct chip8_rewind *rw)
+{
+	free(rw->ring);
+	rw->ring = NULL;
+}
+
+/*
+ * Record the current frame. The first push only sets the starting point; every later one adds
+ * one rewindable frame. Returns -1 if a single delta is larger than the whole ring, in which
+ * case the history is cleared and the current frame becomes the new starting point.
+ */
+int chip8_rewind_push(struct chip8_rewind *rw, const CHIP8 *ch8)
+{
+	u8 cur[CHIP8_IMAGE_SIZE];
+	u8 len_bytes[4];
+	size_t len;
+
+	put_image(cur, ch8);
+	if (!rw->has_image) {
+		memcpy(rw->image, cur, CHIP8_IMAGE_SIZE);
+		rw->has_image = 1;
+		return 0;
+	}
+	len = delta_encode(rw->scratch, cur, rw->image);
+	memcpy(rw->image, cur, CHIP8_IMAGE_SIZE);
+	if (len + 8 > rw->capacity) {
+		rw->head = rw->tail = rw->used = 0;
+		rw->frames = 0;
+		return -1;
+	}
+	while (rw->used + len + 8 > rw->capacity) {
+		ring_drop_oldest(rw);
+	}
+	len_bytes[0] = (u8)len;
+	len_bytes[1] = (u8)(len >> 8);
+	len_bytes[2] = (u8)(len >> 16);
+	len_bytes[3] = (u8)(len >> 24);
+	ring_write(rw, len_bytes, 4);
+	ring_write(rw, rw->scratch, len);
+	ring_write(rw, len_bytes, 4);
+	rw->used += len + 8;
+	rw->frames++;
+	return 0;
+}
+
+/*
+ * Put ch8 back into the frame recorded before the last push and drop that push. Anything ch8
+ * did since the last push is discarded too. Returns -1 if there is no older frame left.
+ */
+int chip8_rewind_pop(struct chip8_rewind *rw, CHIP8 *ch8)
+{
+	size_t end;
+	u32 len;
+
+	if (rw->frames == 0) {
+		return -1;
+	}
+	end = (rw->head + rw->capacity - 4) % rw->capacity;
+	len = ring_read_len(rw, end);
+	ring_read(rw, (end + rw->capacity - len) % rw->capacity, rw->scratch, len);
+	delta_apply(rw->image, rw->scratch, len);
+	rw->head = (end + rw->capacity - len - 4) % rw->capacity;
+	rw->used -= len + 8;
+	rw->frames--;
+	get_image(ch8, rw->image);
+	return 0;
+}
+
+
+/*
+ * Shared ROMs.
  *
- * The interpreter generates a random number from 0 to 255, which is then ANDed with the value kk. The results are stored in Vx. See instruction 8xy2 for more information on AND.
+ * Thousands of machines running the same ROM do not each need their own 4 KB of memory. A
+ * chip8_rom_cache interns ROMs by content: chip8_rom_intern returns the one read-only power-on
+ * memory image (font plus ROM) held for those bytes, however often it is asked for. A
+ * chip8_instance is a machine without memory; it holds everything else a CHIP8 does, a pointer
+ * to its ROM and, for each page it has changed, a private copy of that page.
+ *
+ * Instances are run on a chip8_runner, an ordinary CHIP8 that stays hot in cache and keeps any
+ * decode cache or JIT attached to it. chip8_instance_run loads the instance into the runner,
+ * runs it and stores it back. The load only rewrites the pages that differ between what the
+ * runner holds and what the instance needs, and the store only copies back the pages that
+ * differ from the ROM, so instances that do not write to memory cost their registers and
+ * display and nothing else. An instance gets room for the hi-res display the first time it is
+ * stored in hi-res mode, and the display is only copied in and out while it is in that mode.
+ * Every instance starts from the same RND state; chip8_instance_seed gives each its own.
  */
-void cxkk_rnd_vx_byte(CHIP8 *ch8, u8 x, u8 kk)
+#define CHIP8_ROM_BUCKETS 64
+
+/* The part of a CHIP8 an instance holds: everything between memory and the cycle counter. */
+#define CHIP8_INSTANCE_REGS_SIZE (offsetof(CHIP8, cycles) - offsetof(CHIP8, V))
+
+struct chip8_rom {
+	struct chip8_rom *next;
+	u64 hash;
+	u32 refs;
+	u16 len;
+	u8 memory[MEMORY_SIZE];
+};
+
+struct chip8_rom_cache {
+	struct chip8_rom *buckets[CHIP8_ROM_BUCKETS];
+};
+
+struct chip8_instance {
+	const struct chip8_rom *rom;
+	struct chip8_page *overlay[MEMORY_PAGES];
+	u64 cycles;
+	u8 regs[CHIP8_INSTANCE_REGS_SIZE];
+	u64 (*hires_display)[2];
+};
+
+struct chip8_runner {
+	CHIP8 machine;
+	const struct chip8_rom *rom;
+	u16 dirty;
+};
+
+static u64 rom_hash(const u8 *rom, size_t len)
 {
-	u8 byte = get_random_byte();
-	ch8->V[x] = byte & kk;
+	u64 h = 0xcbf29ce484222325ull;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h = (h ^ rom[i]) * 0x100000001b3ull;
+	}
+	return h;
+}
+
+void chip8_rom_cache_init(struct chip8_rom_cache *cache)
+{
+	memset(cache, 0, sizeof(*cache));
+}
+
+/*
+ * Return the shared image for the len bytes at rom, creating it if this is the first time they
+ * are seen. Every call takes a reference that chip8_rom_release drops. Returns NULL if the ROM
+ * does not fit or the image could not be allocated.
+ */
+const struct chip8_rom *chip8_rom_intern(struct chip8_rom_cache *cache, const u8 *rom, size_t len)
+{
+	u64 hash;
+	struct chip8_rom **bucket;
+	struct chip8_rom *r;
+
+	if (len > CHIP8_ROM_MAX) {
+		return NULL;
+	}
+	hash = rom_hash(rom, len);
+	bucket = &cache->buckets[hash % CHIP8_ROM_BUCKETS];
+	for (r = *bucket; r; r = r->next) {
+		if (r->hash == hash && r->len == len &&
+		    memcmp(r->memory + PROGRAM_START_ADDRESS, rom, len) == 0) {
+			r->refs++;
+			return r;
+		}
+	}
+	r = malloc(sizeof(*r));
+	if (!r) {
+		return NULL;
+	}
+	fill_memory(r->memory, rom, len);
+	r->hash = hash;
+	r->len = (u16)len;
+	r->refs = 1;
+	r->next = *bucket;
+	*bucket = r;
+	return r;
+}
+
+/*
+ * Drop a reference taken by chip8_rom_intern, freeing the image with the last one.
+ */
+void chip8_rom_release(struct chip8_rom_cache *cache, const struct chip8_rom *rom)
+{
+	struct chip8_rom **p = &cache->buckets[rom->hash % CHIP8_ROM_BUCKETS];
+
+	for (; *p; p = &(*p)->next) {
+		if (*p == rom) {
+			if (--(*p)->refs == 0) {
+				struct chip8_rom *r = *p;
+
+				*p = r->next;
+				free(r);
+			}
+			return;
+		}
+	}
+}
+
+/*
+ * Free every image still in cache.
+ */
+void chip8_rom_cache_free(struct chip8_rom_cache *cache)
+{
+	int i;
+
+	for (i = 0; i < CHIP8_ROM_BUCKETS; i++) {
+		while (cache->buckets[i]) {
+			struct chip8_rom *r = cache->buckets[i];
+
+			cache->buckets[i] = r->next;
+			free(r);
+		}
+	}
+}
+
+/*
+ * Set up inst in the power-on state for rom, which must stay interned while inst uses it.
+ */
+void chip8_instance_init(struct chip8_instance *inst, const struct chip8_rom *rom)
+{
+	CHIP8 m;
+
+	memset(&m, 0, sizeof(m));
+	m.pc = PROGRAM_START_ADDRESS;
+	m.dirty_rows = 0xFFFFFFFF;
+	memset(inst, 0, sizeof(*inst));
+	memcpy(inst->regs, (u8 *)&m + offsetof(CHIP8, V), CHIP8_INSTANCE_REGS_SIZE);
+	inst->rom = rom;
+}
+
+/*
+ * Seed the RND state of inst, which chip8_instance_init leaves at zero, so instances of one ROM
+ * can draw different sequences.
+ */
+void chip8_instance_seed(struct chip8_instance *inst, u64 seed)
+{
+	memcpy(inst->regs + offsetof(CHIP8, rng_state) - offsetof(CHIP8, V), &seed, sizeof(seed));
+}
+
+/*
+ * Free the pages inst has written to.
+ */
+void chip8_instance_free(struct chip8_instance *inst)
+{
+	int i;
+
+	for (i = 0; i < MEMORY_PAGES; i++) {
+		if (inst->overlay[i] && --inst->overlay[i]->refs == 0) {
+			free(inst->overlay[i]);
+		}
+		inst->overlay[i] = NULL;
+	}
+	free(inst->hires_display);
+	inst->hires_display = NULL;
+}
+
+void chip8_runner_init(struct chip8_runner *runner)
+{
+	memset(runner, 0, sizeof(*runner));
+}
+
+static const u8 *instance_page(const struct chip8_instance *inst, int page)
+{
+	if (inst->overlay[page]) {
+		return inst->overlay[page]->data;
+	}
+	return &inst->rom->memory[page * MEMORY_PAGE_SIZE];
+}
+
+static void instance_load(struct chip8_runner *runner, const struct chip8_instance *inst)
+{
+	CHIP8 *ch8 = &runner->machine;
+	u16 refresh = 0;
+	int i;
+
+	for (i = 0; i < MEMORY_PAGES; i++) {
+		refresh |= (inst->overlay[i] != NULL) << i;
+	}
+	if (runner->rom != inst->rom) {
+		memcpy(ch8->memory, inst->rom->memory, MEMORY_SIZE);
+		drop_code(ch8);
+		runner->rom = inst->rom;
+	} else {
+		refresh |= runner->dirty;
+	}
+	runner->dirty = refresh;
+	for (i = 0; refresh; i++, refresh >>= 1) {
+		if (refresh & 1) {
+			restore_page(ch8, i, instance_page(inst, i));
+		}
+	}
+	memcpy((u8 *)ch8 + offsetof(CHIP8, V), inst->regs, CHIP8_INSTANCE_REGS_SIZE);
+	ch8->cycles = inst->cycles;
+	if (ch8->hires) {
+		if (inst->hires_display) {
+			memcpy(ch8->hires_display, inst->hires_display, sizeof(ch8->hires_display));
+		} else {
+			memset(ch8->hires_display, 0, sizeof(ch8->hires_display));
+		}
+	}
+}
+
+/*
+ * Save the runner's machine into inst. The pages written since the load are compared with what
+ * inst had and copied into its overlay where they changed; afterwards the runner's dirty pages
+ * are exactly those that no longer match the ROM, and the written pages start over from none.
+ */
+static int instance_store(struct chip8_runner *runner, struct chip8_instance *inst)
+{
+	CHIP8 *ch8 = &runner->machine;
+	u16 written = ch8->written_pages;
+	u16 check = runner->dirty | written;
+	u16 dirty = 0;
+	int ret = 0;
+	int i;
+
+	ch8->written_pages = 0;
+	memcpy(inst->regs, (u8 *)ch8 + offsetof(CHIP8, V), CHIP8_INSTANCE_REGS_SIZE);
+	inst->cycles = ch8->cycles;
+	if (ch8->hires) {
+		if (!inst->hires_display) {
+			inst->hires_display = malloc(sizeof(ch8->hires_display));
+		}
+		if (inst->hires_display) {
+			memcpy(inst->hires_display, ch8->hires_display, sizeof(ch8->hires_display));
+		} else {
+			ret = -1;
+		}
+	}
+	for (i = 0; i < MEMORY_PAGES; i++) {
+		const u8 *data = &ch8->memory[i * MEMORY_PAGE_SIZE];
+
+		if (((check >> i) & 1) &&
+		    memcmp(data, &inst->rom->memory[i * MEMORY_PAGE_SIZE], MEMORY_PAGE_SIZE) != 0) {
+			dirty |= 1u << i;
+		}
+		if (!((written >> i) & 1) ||
+		    memcmp(data, instance_page(inst, i), MEMORY_PAGE_SIZE) == 0) {
+			continue;
+		}
+		if (!inst->overlay[i] || inst->overlay[i]->refs > 1) {
+			struct chip8_page *page = malloc(sizeof(*page));
+
+			if (!page) {
+				ret = -1;
+				continue;
+			}
+			if (inst->overlay[i]) {
+				inst->overlay[i]->refs--;
+			}
+			page->refs = 1;
+			inst->overlay[i] = page;
+		}
+		memcpy(inst->overlay[i]->data, data, MEMORY_PAGE_SIZE);
+	}
+	runner->dirty = dirty;
+	return ret;
+}
+
+/*
+ * Run inst for n_cycles on runner. Returns -1 if a page inst wrote to, or its hi-res display,
+ * could not be given its private copy, in which case those writes are lost.
+ */
+int chip8_instance_run(struct chip8_runner *runner, struct chip8_instance *inst, u32 n_cycles)
+{
+	instance_load(runner, inst);
+	chip8_run(&runner->machine, n_cycles);
+	return instance_store(runner, inst);
+}
+
+/*
+ * chip8_run_frames for inst on runner. Returns -1 as chip8_instance_run does; the idle state is
+ * left to chip8_idle_state on the runner's machine, which still holds inst afterwards.
+ */
+int chip8_instance_run_frames(struct chip8_runner *runner, struct chip8_instance *inst,
+			      struct chip8_clock *clock, u64 n_frames)
+{
+	instance_load(runner, inst);
+	chip8_run_frames(&runner->machine, clock, n_frames);
+	return instance_store(runner, inst);
 }
 
+/*
+ * Headless fast-forward.
+ *
+ * chip8_fast_forward runs n_frames 60 Hz frames as fast as the host allows, for test farms that
+ * only look at the end state. It is chip8_run_frames without presentation: nothing reads frame
+ * diffs, expands the framebuffer or renders audio along the way, and idle frames are skipped as
+ * usual. The interpreter itself runs unchanged. DRW still draws into display, since the
+ * collision flag in VF depends on what is already there, and CLS, DRW and the scrolls still set
+ * their dirty-row bits, one OR per changed row, so display is current whenever the call returns;
+ * splitting the run into several calls gives the frames in between. All rows are marked dirty on
+ * return, so a frontend taking over redraws everything.
+ *
+ * Whatever engine is attached is used as it is, so a host that fast-forwards in many short calls
+ * attaches its JIT or decode cache once and keeps it. With none, the call runs out of a decode
+ * cache of its own, which costs one allocation; a JIT is never created here, since its arena and
+ * table cost more to set up than a short run gains from it. Returns the number of instructions
+ * executed, skipped idle loops included, which over the wall-clock time of the call is the
+ * emulated cycles per second. chip8_display_hash then gives the final frame in a form that can be
+ * checked against a golden value.
+ */
+u64 chip8_fast_forward(CHIP8 *ch8, struct chip8_clock *clock, u64 n_frames)
+{
+	u64 start = ch8->cycles;
+	struct chip8_icache *icache = NULL;
+
+	if (!ch8->aot && !ch8->jit && !ch8->icache) {
+		icache = malloc(sizeof(*icache));
+		chip8_icache_attach(ch8, icache);
+	}
+	chip8_run_frames(ch8, clock, n_frames);
+	ch8->dirty_rows = ~(u32)0;
+	ch8->hires_dirty_rows = ~(u64)0;
+	if (icache) {
+		chip8_icache_attach(ch8, NULL);
+		free(icache);
+	}
+	return ch8->cycles - start;
+}
@@ -0,0 +1,360 @@
+/*
+ * Translate a ROM into C ahead of time.
+ *
+ *	cc -std=c99 -O2 -o c8aot tools/c8aot.c
+ *	./c8aot [-n name] [-q default|vip|chip48|schip] pong.ch8 > pong_aot.c
+ *
+ * The output is meant to be included after chip8.c in the same translation unit:
+ *
+ *	#include "chip8.c"
+ *	#include "pong_aot.c"
+ *	...
+ *	chip8_load_rom(&ch8, rom, len);
+ *	chip8_aot_attach(&ch8, &pong);
+ *
+ * chip8_analyze finds the basic blocks, and each becomes a label in one function that calls
+ * the instr_* handlers in order and jumps straight to the next block wherever the target is
+ * known. Only 00EE, Bnnn and an instruction that changes pc unexpectedly, such as Fx0A
+ * waiting for a key, go back through the switch on pc, and a pc the switch doesn't know
+ * returns to the interpreter. A block charges its whole length against the cycle budget on
+ * entry and refunds what it doesn't run when it stops early, so cycles stay exact.
+ *
+ * The name defaults to the ROM's file name without its extension. -q picks the quirk profile
+ * the program is translated for, default unless given; chip8_aot_attach only accepts a machine
+ * set to the same profile.
+ */
+#include "../chip8.c"
+
+#include <ctype.h>
+#include <stdio.h>
+
+#define BYTES_PER_LINE 12
+
+/* Instructions that neither read nor write pc or memory, and what to call for each. */
+static const struct {
+	chip8_op op;
+	const char *call;
+} plain[] = {
+	{ op_0nnn, "instr_0nnn(ch8, %a)" },
+	{ op_00cn, "instr_00cn_scd_nibble(ch8, %n)" },
+	{ op_00e0, "instr_00e0_cls(ch8)" },
+	{ op_00fb, "instr_00fb_scr(ch8)" },
+	{ op_00fc, "instr_00fc_scl(ch8)" },
+	{ op_00fe, "instr_00fe_low(ch8)" },
+	{ op_00ff, "instr_00ff_high(ch8)" },
+	{ op_6xkk, "instr_6xkk_ld_vx_byte(ch8, %x, %k)" },
+	{ op_7xkk, "instr_7xkk_add_vx_byte(ch8, %x, %k)" },
+	{ op_8xy0, "instr_8xy0_ld_vx_vy(ch8, %x, %y)" },
+	{ op_8xy1, "quirk_8xy1(ch8, %x, %y, %q)" },
+	{ op_8xy2, "quirk_8xy2(ch8, %x, %y, %q)" },
+	{ op_8xy3, "quirk_8xy3(ch8, %x, %y, %q)" },
+	{ op_8xy4, "instr_8xy4_add_vx_vy(ch8, %x, %y)" },
+	{ op_8xy5, "instr_8xy5_sub_vx_vy(ch8, %x, %y)" },
+	{ op_8xy6, "quirk_8xy6(ch8, %x, %y, %q)" },
+	{ op_8xy7, "instr_8xy7_subn_vx_vy(ch8, %x, %y)" },
+	{ op_8xye, "quirk_8xye(ch8, %x, %y, %q)" },
+	{ op_annn, "instr_annn_ld_i_addr(ch8, %a)" },
+	{ op_cxkk, "cxkk_rnd_vx_byte(ch8, %x, %k)" },
+	{ op_dxyn, "instr_dxyn_drw_vx_vy_nibble(ch8, %x, %y, %n)" },
+	{ op_fx07, "instr_fx07_ld_vx_dt(ch8, %x)" },
+	{ op_fx15, "instr_fx15_ld_dt_vx(ch8, %x)" },
+	{ op_fx18, "instr_fx18_ld_st_vx(ch8, %x)" },
+	{ op_fx1e, "instr_fx1e_add_i_vx(ch8, %x)" },
+	{ op_fx29, "instr_fx29_ld_f_vx(ch8, %x)" },
+	{ op_fx65, "quirk_fx65(ch8, %x, %q)" },
+};
+
+/* The skips, which end a block with both outcomes known. */
+static const struct {
+	chip8_op op;
+	const char *call;
+} skips[] = {
+	{ op_3xkk, "instr_3xkk_se_vx_byte(ch8, %x, %k)" },
+	{ op_4xkk, "instr_4xkk_sne_vx_byte(ch8, %x, %k)" },
+	{ op_5xy0, "instr_5xy0_se_vx_vy(ch8, %x, %y)" },
+	{ op_9xy0, "instr_9xy0_sne_vx_vy(ch8, %x, %y)" },
+	{ op_ex9e, "instr_ex9e_skp_vx(ch8, %x)" },
+	{ op_exa1, "instr_exa1_sknp_vx(ch8, %x)" },
+};
+
+static const char *const profiles[CHIP8_QUIRK_PROFILES] = {
+	[CHIP8_QUIRKS_DEFAULT] = "default",
+	[CHIP8_QUIRKS_VIP] = "vip",
+	[CHIP8_QUIRKS_CHIP48] = "chip48",
+	[CHIP8_QUIRKS_SCHIP] = "schip",
+};
+
+static const char *const profile_names[CHIP8_QUIRK_PROFILES] = {
+	[CHIP8_QUIRKS_DEFAULT] = "CHIP8_QUIRKS_DEFAULT",
+	[CHIP8_QUIRKS_VIP] = "CHIP8_QUIRKS_VIP",
+	[CHIP8_QUIRKS_CHIP48] = "CHIP8_QUIRKS_CHIP48",
+	[CHIP8_QUIRKS_SCHIP] = "CHIP8_QUIRKS_SCHIP",
+};
+
+static const char *name;
+static u8 quirks;
+
+static void emit_call(const char *call, u16 opcode)
+{
+	printf("\t\t");
+	for (; *call; call++) {
+		if (*call != '%') {
+			putchar(*call);
+			continue;
+		}
+		switch (*++call) {
+		case 'x':
+			printf("0x%X", OPCODE_X(opcode));
+			break;
+		case 'y':
+			printf("0x%X", OPCODE_Y(opcode));
+			break;
+		case 'n':
+			printf("%u", OPCODE_N(opcode));
+			break;
+		case 'k':
+			printf("0x%02X", OPCODE_KK(opcode));
+			break;
+		case 'a':
+			printf("0x%03X", OPCODE_NNN(opcode));
+			break;
+		case 'q':
+			printf("%s", profile_names[quirks]);
+			break;
+		}
+	}
+	printf(";\n");
+}
+
+static const char *find(chip8_op op, int want_skip)
+{
+	size_t i;
+
+	if (want_skip) {
+		for (i = 0; i < sizeof(skips) / sizeof(skips[0]); i++) {
+			if (skips[i].op == op) {
+				return skips[i].call;
+			}
+		}
+		return NULL;
+	}
+	for (i = 0; i < sizeof(plain) / sizeof(plain[0]); i++) {
+		if (plain[i].op == op) {
+			return plain[i].call;
+		}
+	}
+	return NULL;
+}
+
+/* Set pc and go to the block at addr, which the analysis guarantees exists. */
+static void emit_goto(u16 addr)
+{
+	printf("\t\tch8->pc = 0x%03X;\n\t\tgoto b_%03X;\n", addr, addr);
+}
+
+static void emit_block(const u8 *memory, const struct chip8_block *block)
+{
+	u16 count = 0;
+	u16 addr;
+
+	for (addr = block->start; addr < block->end; addr += 2) {
+		count++;
+	}
+	printf("\nb_%03X:\n", block->start);
+	printf("\t\tif (left < %u) {\n\t\t\treturn n_cycles - left;\n\t\t}\n", count);
+	printf("\t\tleft -= %u;\n", count);
+	for (addr = block->start; addr < block->end; addr += 2) {
+		u16 opcode = (memory[addr] << 8) | memory[addr + 1];
+		/* Other groups take the profile in their quirk_* calls; the 0 group's is resolved here. */
+		chip8_op op = opcode & 0xF000 ? chip8_lookup(opcode) : quirk_lookup(opcode, quirks);
+		u16 next = addr + 2;
+		u16 after = (block->end - next) / 2;
+		char text[CHIP8_DISASM_MAX];
+		const char *call;
+
+		chip8_disassemble(opcode, text);
+		printf("\t\t/* %03X  %s */\n", addr, text);
+		if ((call = find(op, 0)) != NULL) {
+			emit_call(call, opcode);
+		} else if (op == op_unknown) {
+			continue;
+		} else if (op == op_1nnn) {
+			if (block->n_succ) {
+				emit_goto(block->succ[0]);
+			} else {
+				printf("\t\tch8->pc = 0x%03X;\n\t\tcontinue;\n", OPCODE_NNN(opcode));
+			}
+			return;
+		} else if (op == op_2nnn && (block->flags & CHIP8_BLOCK_CALL)) {
+			printf("\t\tch8->pc = 0x%03X;\n", next);
+			printf("\t\tinstr_2nnn_call_addr(ch8, 0x%03X);\n", OPCODE_NNN(opcode));
+			printf("\t\tgoto b_%03X;\n", OPCODE_NNN(opcode));
+			return;
+		} else if ((call = find(op, 1)) != NULL) {
+			printf("\t\tch8->pc = 0x%03X;\n", next);
+			emit_call(call, opcode);
+			if (block->n_succ == 2) {
+				printf("\t\tif (ch8->pc != 0x%03X) {\n\t\t\tgoto b_%03X;\n\t\t}\n", next,
+				       block->succ[1]);
+				printf("\t\tgoto b_%03X;\n", block->succ[0]);
+			} else {
+				printf("\t\tcontinue;\n");
+			}
+			return;
+		} else if (op == op_00ee) {
+			printf("\t\tinstr_00ee_ret(ch8);\n\t\tcontinue;\n");
+			return;
+		} else if (op == op_bnnn) {
+			printf("\t\tquirk_bnnn(ch8, 0x%03X, %s);\n\t\tcontinue;\n",
+			       OPCODE_NNN(opcode), profile_names[quirks]);
+			return;
+		} else {
+			/* Fx0A, and anything else that might move pc or write memory, like Fx55. */
+			printf("\t\tch8->pc = 0x%03X;\n", next);
+			if (op == op_fx0a) {
+				printf("\t\tinstr_fx0a_ld_vx_k(ch8, 0x%X);\n", OPCODE_X(opcode));
+			} else {
+				printf("\t\tchip8_aot_exec(ch8, 0x%04X);\n", opcode);
+			}
+			printf("\t\tif (ch8->pc != 0x%03X || ch8->aot != &%s) {\n", next, name);
+			if (after) {
+				printf("\t\t\tleft += %u;\n", after);
+			}
+			printf("\t\t\tcontinue;\n\t\t}\n");
+		}
+	}
+	if (block->n_succ) {
+		emit_goto(block->succ[0]);
+	} else {
+		printf("\t\tch8->pc = 0x%03X;\n\t\tcontinue;\n", block->end);
+	}
+}
+
+static void emit(const struct chip8_cfg *cfg, const u8 *memory, const u8 *rom, size_t len,
+		 const char *path)
+{
+	u16 code_pages = 0;
+	size_t i;
+
+	for (i = 0; i < MEMORY_SIZE; i++) {
+		if (cfg->map[i] & CHIP8_MAP_CODE) {
+			code_pages |= 1u << (i / MEMORY_PAGE_SIZE);
+		}
+	}
+	printf("/*\n * Translated from %s by c8aot. Include this file after chip8.c and attach it\n"
+	       " * with chip8_aot_attach(ch8, &%s) once the ROM is loaded.\n */\n", path, name);
+	printf("static const struct chip8_aot %s;\n\n", name);
+	printf("static const u8 %s_rom[%lu] = {", name, (unsigned long)len);
+	for (i = 0; i < len; i++) {
+		printf("%s0x%02X,", i % BYTES_PER_LINE ? " " : "\n\t", rom[i]);
+	}
+	printf("\n};\n\n");
+
+	printf("static u32 %s_run(CHIP8 *ch8, u32 n_cycles)\n{\n", name);
+	printf("\tu32 left = n_cycles;\n\n");
+	printf("\tfor (;;) {\n");
+	printf("\t\tif (ch8->aot != &%s) {\n\t\t\treturn n_cycles - left;\n\t\t}\n", name);
+	printf("\t\tswitch (ch8->pc) {\n");
+	for (i = 0; i < cfg->n_blocks; i++) {
+		printf("\t\tcase 0x%03X:\n\t\t\tgoto b_%03X;\n", cfg->blocks[i].start,
+		       cfg->blocks[i].start);
+	}
+	printf("\t\tdefault:\n\t\t\treturn n_cycles - left;\n\t\t}\n");
+	for (i = 0; i < cfg->n_blocks; i++) {
+		emit_block(memory, &cfg->blocks[i]);
+	}
+	printf("\t}\n}\n\n");
+
+	printf("static const struct chip8_aot %s = {\n", name);
+	printf("\t%s_rom, sizeof(%s_rom), 0x%04X, %s, %s_run,\n};\n", name, name, code_pages,
+	       profile_names[quirks], name);
+}
+
+/* The file name without its directory and extension, as a C identifier. */
+static char *default_name(const char *path)
+{
+	const char *base = strrchr(path, '/');
+	size_t len;
+	char *out;
+	size_t i;
+
+	base = base ? base + 1 : path;
+	len = strcspn(base, ".");
+	out = malloc(len + 2);
+	if (!out) {
+		return NULL;
+	}
+	out[0] = '_';
+	for (i = 0; i < len; i++) {
+		out[i + 1] = isalnum((unsigned char)base[i]) ? base[i] : '_';
+	}
+	out[len + 1] = '\0';
+	return len && !isdigit((unsigned char)base[0]) ? out + 1 : out;
+}
+
+static int usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-n name] [-q default|vip|chip48|schip] rom.ch8\n", argv0);
+	return 1;
+}
+
+static int parse_profile(const char *arg)
+{
+	int i;
+
+	for (i = 0; i < CHIP8_QUIRK_PROFILES; i++) {
+		if (!strcmp(arg, profiles[i])) {
+			quirks = i;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+int main(int argc, char **argv)
+{
+	static CHIP8 ch8;
+	static struct chip8_cfg cfg;
+	static u8 rom[CHIP8_ROM_MAX + 1];
+	const char *path;
+	FILE *in;
+	size_t len;
+	int i;
+
+	for (i = 1; i < argc - 1; i++) {
+		if (!strcmp(argv[i], "-n") && i + 2 < argc) {
+			name = argv[++i];
+		} else if (!strcmp(argv[i], "-q") && i + 2 < argc) {
+			if (parse_profile(argv[++i]) != 0) {
+				return usage(argv[0]);
+			}
+		} else {
+			return usage(argv[0]);
+		}
+	}
+	if (i != argc - 1) {
+		return usage(argv[0]);
+	}
+	path = argv[i];
+	if (!name) {
+		name = default_name(path);
+	}
+	if (!name) {
+		perror("malloc");
+		return 1;
+	}
+	in = fopen(path, "rb");
+	if (!in) {
+		perror(path);
+		return 1;
+	}
+	len = fread(rom, 1, sizeof(rom), in);
+	fclose(in);
+	if (!len || chip8_load_rom(&ch8, rom, len)) {
+		fprintf(stderr, "%s: empty or larger than %d bytes\n", path, CHIP8_ROM_MAX);
+		return 1;
+	}
+	chip8_analyze(&cfg, ch8.memory, PROGRAM_START_ADDRESS);
+	emit(&cfg, ch8.memory, rom, len, path);
+	return 0;
+}
@@ -0,0 +1,159 @@
+/*
+ * Disassemble a ROM with the control flow worked out by chip8_analyze.
+ *
+ *	cc -std=c99 -O2 -o c8cfg tools/c8cfg.c
+ *	./c8cfg [-b] rom.ch8
+ *
+ * The listing has a label at every subroutine entry (sub_), every other basic block (L_) and
+ * every address Annn points at outside the code (data_). Bytes the analysis never reached as
+ * code are shown as DB lines. After the listing come the call graph, one line per subroutine
+ * with the subroutines it calls, and the addresses of any Bnnn computed jumps, past which the
+ * map can be missing code. -b also lists every basic block with its successors.
+ */
+#include "../chip8.c"
+
+#include <stdio.h>
+
+#define DATA_PER_LINE 8
+
+static void print_label(const struct chip8_cfg *cfg, u16 addr)
+{
+	u8 map = cfg->map[addr];
+
+	if ((map & (CHIP8_MAP_INSN | CHIP8_MAP_SUBROUTINE)) == (CHIP8_MAP_INSN | CHIP8_MAP_SUBROUTINE)) {
+		printf("sub_%03X:\n", addr);
+	} else if ((map & (CHIP8_MAP_INSN | CHIP8_MAP_BLOCK)) == (CHIP8_MAP_INSN | CHIP8_MAP_BLOCK)) {
+		printf("L_%03X:\n", addr);
+	} else if ((map & (CHIP8_MAP_CODE | CHIP8_MAP_DATA_REF)) == CHIP8_MAP_DATA_REF) {
+		printf("data_%03X:\n", addr);
+	}
+}
+
+static void print_listing(const struct chip8_cfg *cfg, const u8 *memory, u16 end)
+{
+	u16 addr = PROGRAM_START_ADDRESS;
+
+	while (addr < end) {
+		print_label(cfg, addr);
+		if (cfg->map[addr] & CHIP8_MAP_INSN) {
+			char text[CHIP8_DISASM_MAX];
+			u16 opcode = (memory[addr] << 8) | memory[addr + 1];
+
+			chip8_disassemble(opcode, text);
+			if (cfg->map[addr] & CHIP8_MAP_COMPUTED) {
+				printf("\t%03X  %04X  %-20s; computed jump\n", addr, opcode, text);
+			} else {
+				printf("\t%03X  %04X  %s\n", addr, opcode, text);
+			}
+			addr += 2;
+		} else {
+			u16 n = 0;
+
+			printf("\t%03X        DB", addr);
+			do {
+				printf(" 0x%02X", memory[addr]);
+				addr++;
+				n++;
+			} while (addr < end && n < DATA_PER_LINE &&
+				 !(cfg->map[addr] & (CHIP8_MAP_INSN | CHIP8_MAP_DATA_REF)));
+			putchar('\n');
+		}
+	}
+}
+
+static void print_blocks(const struct chip8_cfg *cfg)
+{
+	u16 i;
+
+	printf("\n; blocks\n");
+	for (i = 0; i < cfg->n_blocks; i++) {
+		const struct chip8_block *block = &cfg->blocks[i];
+		u8 j;
+
+		printf(";\t%03X-%03X", block->start, block->end - 2);
+		for (j = 0; j < block->n_succ; j++) {
+			printf(" %s%03X", j == 0 && (block->flags & CHIP8_BLOCK_CALL) ? "call " : "",
+			       block->succ[j]);
+		}
+		if (block->flags & CHIP8_BLOCK_RETURN) {
+			printf(" ret");
+		}
+		if (block->flags & CHIP8_BLOCK_COMPUTED) {
+			printf(" ?");
+		}
+		putchar('\n');
+	}
+}
+
+static void print_calls(const struct chip8_cfg *cfg)
+{
+	u32 addr;
+
+	printf("\n; call graph\n");
+	for (addr = 0; addr < MEMORY_SIZE; addr++) {
+		u16 i;
+
+		if ((cfg->map[addr] & (CHIP8_MAP_INSN | CHIP8_MAP_SUBROUTINE)) !=
+		    (CHIP8_MAP_INSN | CHIP8_MAP_SUBROUTINE)) {
+			continue;
+		}
+		printf(";\tsub_%03X:", (unsigned)addr);
+		for (i = 0; i < cfg->n_calls; i++) {
+			if (cfg->calls[i].caller == addr) {
+				printf(" sub_%03X", cfg->calls[i].callee);
+			}
+		}
+		putchar('\n');
+	}
+}
+
+static void print_computed(const struct chip8_cfg *cfg)
+{
+	u32 addr;
+	int any = 0;
+
+	for (addr = 0; addr < MEMORY_SIZE; addr++) {
+		if (cfg->map[addr] & CHIP8_MAP_COMPUTED) {
+			printf("%s %03X", any ? "" : "\n; computed jumps at", (unsigned)addr);
+			any = 1;
+		}
+	}
+	if (any) {
+		putchar('\n');
+	}
+}
+
+int main(int argc, char **argv)
+{
+	static CHIP8 ch8;
+	static struct chip8_cfg cfg;
+	static u8 rom[CHIP8_ROM_MAX + 1];
+	int blocks = argc > 1 && !strcmp(argv[1], "-b");
+	const char *path = argv[1 + blocks];
+	FILE *in;
+	size_t len;
+
+	if (argc != 2 + blocks) {
+		fprintf(stderr, "usage: %s [-b] rom.ch8\n", argv[0]);
+		return 1;
+	}
+	in = fopen(path, "rb");
+	if (!in) {
+		perror(path);
+		return 1;
+	}
+	len = fread(rom, 1, sizeof(rom), in);
+	fclose(in);
+	if (chip8_load_rom(&ch8, rom, len)) {
+		fprintf(stderr, "%s: larger than %d bytes\n", path, CHIP8_ROM_MAX);
+		return 1;
+	}
+	chip8_analyze(&cfg, ch8.memory, PROGRAM_START_ADDRESS);
+	print_listing(&cfg, ch8.memory, PROGRAM_START_ADDRESS + len);
+	if (blocks) {
+		print_blocks(&cfg);
+	}
+	print_calls(&cfg);
+	print_computed(&cfg);
+	return 0;
+}
@@ -0,0 +1,188 @@
+/*
+ * Run a ROM for a number of emulated seconds and report how it ended.
+ *
+ *	cc -std=c99 -O2 -o c8run tools/c8run.c
+ *	cc -std=c99 -O2 -DCHIP8_JIT -o c8run tools/c8run.c
+ *	./c8run [-f] [-j] [-s seconds] [-i ips] [-m addr:len]... rom.ch8
+ *
+ * By default every frame is presented the way a frontend would, with a frame diff and an expansion
+ * to a scaled RGBA framebuffer. -f fast-forwards headless with chip8_fast_forward instead. -j runs
+ * the ROM through a JIT, in builds with CHIP8_JIT. Either way the result is printed as JSON: the
+ * frames and instructions run, the wall-clock time and emulated cycles per second, the hash of the
+ * final frame and the bytes of memory asked for with -m, as hex. seconds defaults to 10 and ips to
+ * 700.
+ */
+#define _POSIX_C_SOURCE 199309L
+
+#include "../chip8.c"
+
+#include <stdio.h>
+#include <time.h>
+
+#define RUN_SCALE 10
+#define RUN_MAX_DUMPS 16
+
+struct dump {
+	u16 addr;
+	u16 len;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Run frame by frame, presenting each one. The surface is big enough for hi-res mode. Returns
+ * the instructions executed.
+ */
+static u64 run_presented(CHIP8 *ch8, struct chip8_clock *clock, u64 frames)
+{
+	static u32 pixels[DISPLAY_HIRES_HEIGHT * RUN_SCALE][DISPLAY_HIRES_LENGTH * RUN_SCALE];
+	struct chip8_surface surface = {
+		pixels, sizeof(pixels[0]), CHIP8_PIXEL_RGBA8, 0xFFFFFFFF, 0xFF000000, RUN_SCALE,
+	};
+	struct chip8_row_update rows[DISPLAY_HEIGHT];
+	struct chip8_hires_row_update hires_rows[DISPLAY_HIRES_HEIGHT];
+	u64 start = ch8->cycles;
+	u64 i;
+
+	for (i = 0; i < frames && !chip8_faulted(ch8); i++) {
+		u8 changed;
+
+		chip8_run_frames(ch8, clock, 1);
+		changed = chip8_frame_diff(ch8, rows);
+		changed |= chip8_hires_frame_diff(ch8, hires_rows);
+		if (changed) {
+			chip8_expand_display(ch8, &surface);
+		}
+	}
+	return ch8->cycles - start;
+}
+
+static int parse_dump(const char *arg, struct dump *dump)
+{
+	char *end;
+	unsigned long addr = strtoul(arg, &end, 0);
+	unsigned long len;
+
+	if (*end != ':') {
+		return -1;
+	}
+	len = strtoul(end + 1, &end, 0);
+	if (*end || !len || addr >= MEMORY_SIZE || len > MEMORY_SIZE - addr) {
+		return -1;
+	}
+	dump->addr = addr;
+	dump->len = len;
+	return 0;
+}
+
+static int usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-f] [-j] [-s seconds] [-i ips] [-m addr:len]... rom.ch8\n", argv0);
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	static CHIP8 ch8;
+	static u8 rom[CHIP8_ROM_MAX + 1];
+	struct dump dumps[RUN_MAX_DUMPS];
+	int n_dumps = 0;
+	int fast = 0;
+	int use_jit = 0;
+#ifdef CHIP8_JIT
+	struct chip8_jit *jit = NULL;
+#endif
+	double seconds = 10;
+	u32 ips = 700;
+	struct chip8_clock clock;
+	const char *path;
+	FILE *in;
+	size_t len;
+	u64 frames;
+	u64 cycles;
+	double start;
+	double elapsed;
+	int i;
+	int j;
+
+	for (i = 1; i < argc - 1; i++) {
+		if (!strcmp(argv[i], "-f")) {
+			fast = 1;
+		} else if (!strcmp(argv[i], "-j")) {
+			use_jit = 1;
+		} else if (!strcmp(argv[i], "-s") && i + 2 < argc) {
+			seconds = strtod(argv[++i], NULL);
+		} else if (!strcmp(argv[i], "-i") && i + 2 < argc) {
+			ips = (u32)strtoul(argv[++i], NULL, 10);
+		} else if (!strcmp(argv[i], "-m") && i + 2 < argc && n_dumps < RUN_MAX_DUMPS &&
+			   parse_dump(argv[++i], &dumps[n_dumps]) == 0) {
+			n_dumps++;
+		} else {
+			return usage(argv[0]);
+		}
+	}
+	if (i != argc - 1 || seconds <= 0 || !ips) {
+		return usage(argv[0]);
+	}
+	path = argv[i];
+	in = fopen(path, "rb");
+	if (!in) {
+		perror(path);
+		return 1;
+	}
+	len = fread(rom, 1, sizeof(rom), in);
+	fclose(in);
+	if (chip8_load_rom(&ch8, rom, len)) {
+		fprintf(stderr, "%s: larger than %d bytes\n", path, CHIP8_ROM_MAX);
+		return 1;
+	}
+	chip8_seed(&ch8, 1);
+#ifdef CHIP8_JIT
+	if (use_jit) {
+		jit = chip8_jit_create();
+		if (!jit) {
+			fprintf(stderr, "%s: no executable memory for the JIT\n", argv[0]);
+			return 1;
+		}
+		chip8_jit_attach(&ch8, jit);
+	}
+#else
+	if (use_jit) {
+		fprintf(stderr, "%s: built without CHIP8_JIT\n", argv[0]);
+		return 1;
+	}
+#endif
+	chip8_clock_init(&clock, ips);
+	frames = (u64)(seconds * CHIP8_TIMER_HZ + 0.5);
+
+	start = now();
+	cycles = fast ? chip8_fast_forward(&ch8, &clock, frames) :
+			run_presented(&ch8, &clock, frames);
+	elapsed = now() - start;
+
+	printf("{\n\t\"mode\": \"%s\",\n", fast ? "fast-forward" : "presented");
+	printf("\t\"frames\": %llu,\n", (unsigned long long)frames);
+	printf("\t\"cycles\": %llu,\n", (unsigned long long)cycles);
+	printf("\t\"seconds\": %.6f,\n", elapsed);
+	printf("\t\"cycles_per_second\": %.0f,\n", elapsed > 0 ? cycles / elapsed : 0.0);
+	printf("\t\"display_hash\": \"%016llx\",\n", (unsigned long long)chip8_display_hash(&ch8));
+	printf("\t\"memory\": {");
+	for (i = 0; i < n_dumps; i++) {
+		printf("%s\n\t\t\"0x%03X\": \"", i ? "," : "", dumps[i].addr);
+		for (j = 0; j < dumps[i].len; j++) {
+			printf("%02x", ch8.memory[dumps[i].addr + j]);
+		}
+		putchar('"');
+	}
+	printf("%s}\n}\n", n_dumps ? "\n\t" : "");
+#ifdef CHIP8_JIT
+	chip8_jit_destroy(jit);
+#endif
+	return 0;
+}
@@ -0,0 +1,85 @@
+/*
+ * Decode a trace file written by chip8_trace_save into one line of disassembly per instruction.
+ *
+ *	cc -std=c99 -O2 -o c8trace tools/c8trace.c
+ *	./c8trace trace.bin
+ *
+ * Each line has the cycle, the address, the opcode and its disassembly, followed by I and sp
+ * after the instruction and the registers it changed. Values are known for Vx and VF only; any
+ * other changed register is listed without one. A '>' after the address marks an instruction
+ * that did not move pc on to the next one.
+ */
+#ifndef CHIP8_TRACE
+#define CHIP8_TRACE
+#endif
+
+#include "../chip8.c"
+
+#include <stdio.h>
+
+static u32 get32(const u8 *p)
+{
+	return get16(p) | ((u32)get16(p + 2) << 16);
+}
+
+static void print_record(const u8 *p)
+{
+	char text[CHIP8_DISASM_MAX];
+	u32 cycle = get32(p);
+	u16 pc = get16(p + 4);
+	u16 opcode = get16(p + 6);
+	u16 I = get16(p + 8);
+	u16 changed = get16(p + 10);
+	u8 sp = p[12];
+	u8 vx = p[13];
+	u8 vf = p[14];
+	u8 flags = p[15];
+	int i;
+
+	chip8_disassemble(opcode, text);
+	printf("%10lu  %03X%c %04X  %-20s I=%03X%c sp=%X", (unsigned long)cycle, pc,
+	       flags & CHIP8_TRACE_BRANCH ? '>' : ' ', opcode, text, I,
+	       flags & CHIP8_TRACE_I_CHANGED ? '*' : ' ', sp);
+	for (i = 0; i < 16; i++) {
+		if (!((changed >> i) & 1)) {
+			continue;
+		}
+		if (i == 0xF) {
+			printf(" VF=%02X", vf);
+		} else if (i == OPCODE_X(opcode)) {
+			printf(" V%X=%02X", i, vx);
+		} else {
+			printf(" V%X", i);
+		}
+	}
+	putchar('\n');
+}
+
+int main(int argc, char **argv)
+{
+	u8 header[CHIP8_TRACE_HEADER_SIZE];
+	u8 record[CHIP8_TRACE_RECORD_SIZE];
+	FILE *in = argc > 1 ? fopen(argv[1], "rb") : stdin;
+	u32 count;
+	u32 i;
+
+	if (!in) {
+		perror(argv[1]);
+		return 1;
+	}
+	if (fread(header, 1, sizeof(header), in) != sizeof(header) || memcmp(header, "C8TR", 4) ||
+	    header[4] != CHIP8_TRACE_VERSION) {
+		fprintf(stderr, "not a version %d trace file\n", CHIP8_TRACE_VERSION);
+		return 1;
+	}
+	count = get32(header + 8);
+	for (i = 0; i < count; i++) {
+		if (fread(record, 1, sizeof(record), in) != sizeof(record)) {
+			fprintf(stderr, "truncated after %lu of %lu records\n", (unsigned long)i,
+				(unsigned long)count);
+			return 1;
+		}
+		print_record(record);
+	}
+	return 0;
+}